@@ -0,0 +1,94 @@
+// Blocking waits per task on a saturated locked_queue and thread_pool
+//
+// Every time a thread blocks on a futex the kernel counts a voluntary
+// context switch, so the process' count per task shows how often pushing
+// made a waiter wake up for nothing, or block again on the queue's mutex
+// right after being woken.
+
+#include <sys/resource.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+namespace {
+  constexpr int item_count = 1 << 20;
+
+  long voluntary_context_switches() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_nvcsw;
+  }
+
+  template <typename Function> void measure(const char* name, Function run) {
+    const long switches_before = voluntary_context_switches();
+    const auto start = std::chrono::steady_clock::now();
+    run();
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const long switches = voluntary_context_switches() - switches_before;
+
+    std::cout << name << ": "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() /
+                     static_cast<double>(item_count)
+              << " ns/task, " << static_cast<double>(switches) / item_count
+              << " blocking waits/task" << std::endl;
+  }
+
+  // Producers keep the queue full while consumers drain it
+  void saturate_queue() {
+    constexpr int producer_count = 4;
+    constexpr int consumer_count = 4;
+    foo::locked_queue<int> queue;
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < consumer_count; ++i) {
+      threads.emplace_back([&queue] {
+        for (;;) {
+          int value = 0;
+          queue.wait_and_pop(value);
+          if (value < 0) {
+            return;
+          }
+        }
+      });
+    }
+    for (int i = 0; i < producer_count; ++i) {
+      threads.emplace_back([&queue] {
+        for (int value = 0; value < item_count / producer_count; ++value) {
+          queue.push(value);
+        }
+      });
+    }
+    for (std::size_t i = consumer_count; i < threads.size(); ++i) {
+      threads[i].join();
+    }
+    for (int i = 0; i < consumer_count; ++i) {
+      queue.push(-1);
+    }
+    for (int i = 0; i < consumer_count; ++i) {
+      threads[i].join();
+    }
+  }
+
+  // All workers stay busy while tasks keep coming in from outside
+  void saturate_pool() {
+    foo::thread_pool pool;
+    std::atomic<int> done(0);
+    for (int i = 0; i < item_count; ++i) {
+      pool.post([&done] { done.fetch_add(1, std::memory_order_relaxed); });
+    }
+    while (done.load() < item_count) {
+      pool.run_pending_task();
+    }
+  }
+} // namespace
+
+int main() {
+  measure("locked_queue", saturate_queue);
+  measure("thread_pool ", saturate_pool);
+  return 0;
+}
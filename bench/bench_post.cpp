@@ -0,0 +1,80 @@
+// Per-task cost of post() against submit() with the future discarded
+//
+// Counts heap allocations by replacing the global operator new, and times
+// trivial tasks submitted in one burst from outside the pool, and in
+// batches of 32 from a worker that helps run each batch before the next.
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#include "thread_pool.hpp"
+
+namespace {
+  std::atomic<std::size_t> allocations(0);
+} // namespace
+
+void* operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size == 0 ? 1 : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+  constexpr std::size_t task_count = 1000000;
+
+  template <typename Enqueue>
+  void measure(const char* name, bool from_worker, Enqueue enqueue) {
+    foo::thread_pool pool;
+    std::atomic<std::size_t> done(0);
+    const auto task = [&done] { done.fetch_add(1, std::memory_order_relaxed); };
+
+    const auto allocations_before = allocations.load();
+    const auto start = std::chrono::steady_clock::now();
+    if (from_worker) {
+      pool.post([&pool, &task, &enqueue] {
+        for (std::size_t i = 0; i < task_count; ++i) {
+          enqueue(pool, task);
+          if (i % 32 == 31) {
+            while (pool.run_pending_task()) {
+            }
+          }
+        }
+      });
+    } else {
+      for (std::size_t i = 0; i < task_count; ++i) {
+        enqueue(pool, task);
+      }
+    }
+    while (done.load() < task_count) {
+      pool.run_pending_task();
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const auto allocated = allocations.load() - allocations_before;
+
+    std::cout << name << ": "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() /
+                     static_cast<double>(task_count)
+              << " ns/task, " << static_cast<double>(allocated) / task_count
+              << " allocations/task" << std::endl;
+  }
+} // namespace
+
+int main() {
+  const auto submit = [](foo::thread_pool& pool, const auto& task) { pool.submit(task); };
+  const auto post = [](foo::thread_pool& pool, const auto& task) { pool.post(task); };
+  measure("submit             ", false, submit);
+  measure("post               ", false, post);
+  measure("submit from worker ", true, submit);
+  measure("post from worker   ", true, post);
+  return 0;
+}
@@ -0,0 +1,70 @@
+// Throughput of mpmc_queue against locked_queue under contention
+//
+// 1, 4, 16 and 64 producers push their share of the items while four
+// consumers take them with wait_and_pop; a negative value tells a consumer
+// to stop. The lock-free queue is sized well below the number of items, so
+// producers also hit its full slow path.
+
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+namespace {
+  constexpr int item_count = 1 << 21;
+  constexpr int consumer_count = 4;
+
+  template <typename Queue> double measure(Queue& queue, int producer_count) {
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> consumers;
+    for (int i = 0; i < consumer_count; ++i) {
+      consumers.emplace_back([&queue] {
+        for (;;) {
+          int value = 0;
+          queue.wait_and_pop(value);
+          if (value < 0) {
+            return;
+          }
+        }
+      });
+    }
+
+    std::vector<std::thread> producers;
+    for (int i = 0; i < producer_count; ++i) {
+      producers.emplace_back([&queue, producer_count] {
+        for (int value = 0; value < item_count / producer_count; ++value) {
+          queue.push(value);
+        }
+      });
+    }
+    for (auto& producer : producers) {
+      producer.join();
+    }
+    for (int i = 0; i < consumer_count; ++i) {
+      queue.push(-1);
+    }
+    for (auto& consumer : consumers) {
+      consumer.join();
+    }
+
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() /
+           static_cast<double>(item_count);
+  }
+} // namespace
+
+int main() {
+  for (const int producers : {1, 4, 16, 64}) {
+    foo::locked_queue<int> locked;
+    foo::mpmc_queue<int> lock_free(1024);
+    const double locked_time = measure(locked, producers);
+    const double lock_free_time = measure(lock_free, producers);
+    std::cout << producers << " producers: locked_queue " << locked_time << " ns/item, mpmc_queue "
+              << lock_free_time << " ns/item" << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,85 @@
+// Cost of tiny tasks while every worker is busy with its own queue
+//
+// Each worker posts and runs batches of trivial tasks through its own
+// queue; a start barrier makes sure every worker takes exactly one of the
+// outer tasks doing so. There is nothing to contend on but cache lines the
+// workers happen to share: the pool's atomics, neighbouring worker slots
+// and the queue wait counters. Without false sharing the time per task
+// stays flat as workers are added. perf c2c shows the lines involved.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+namespace {
+  constexpr std::size_t tasks_per_worker = 1 << 20;
+
+  // Tasks run so far of the batches one worker posted; stolen tasks count
+  // there as well, so it is atomic, and padded so counting shares nothing
+  struct alignas(foo::internal::cache_line_size) task_counter {
+    std::atomic<std::size_t> tasks{0};
+  };
+
+  double measure(unsigned int workers) {
+    // Outlives the pool, and so every task that counts on it
+    std::vector<task_counter> counters(workers);
+    foo::thread_pool_options options;
+    options.thread_count = workers;
+    foo::thread_pool pool(options);
+
+    // Outer tasks that started; a worker spins in its outer task until all
+    // did, so none can take a second one
+    std::atomic<unsigned int> arrived(0);
+
+    const auto start = std::chrono::steady_clock::now();
+    for (unsigned int worker = 0; worker < workers; ++worker) {
+      pool.post([&pool, &arrived, workers, &counter = counters[worker]] {
+        arrived.fetch_add(1);
+        while (arrived.load() < workers) {
+          std::this_thread::yield();
+        }
+        for (std::size_t i = 0; i < tasks_per_worker; ++i) {
+          pool.post([&counter] { counter.tasks.fetch_add(1, std::memory_order_relaxed); });
+          if (i % 32 == 31) {
+            while (pool.run_pending_task()) {
+            }
+          }
+        }
+        while (pool.run_pending_task()) {
+        }
+      });
+    }
+    const auto total = [&counters] {
+      std::size_t tasks = 0;
+      for (const auto& counter : counters) {
+        tasks += counter.tasks.load(std::memory_order_relaxed);
+      }
+      return tasks;
+    };
+    while (total() < tasks_per_worker * workers) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() /
+           static_cast<double>(tasks_per_worker * workers);
+  }
+} // namespace
+
+// Usage: bench_sharing [max_workers], where max_workers defaults to the
+// number of CPUs
+int main(int argc, char* argv[]) {
+  const unsigned int max_workers =
+      argc > 1 ? static_cast<unsigned int>(std::stoul(argv[1]))
+               : std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned int workers = 1; workers <= max_workers; workers *= 2) {
+    std::cout << workers << " workers: " << measure(workers) << " ns/task" << std::endl;
+  }
+  return 0;
+}
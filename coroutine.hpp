@@ -0,0 +1,286 @@
+#pragma once
+
+// Coroutine support; empty unless compiled as C++20 (see ENABLE_CXX20)
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#  include <coroutine>
+#  include <exception>
+#  include <optional>
+#  include <type_traits>
+#  include <utility>
+
+#  include "future.hpp"
+#  include "thread_pool.hpp"
+
+namespace foo {
+  template <typename T = void> class task;
+
+  namespace internal {
+    struct task_promise_base {
+      // Resumed when the task completes
+      std::coroutine_handle<> continuation;
+      std::exception_ptr exception;
+
+      // On completion, transfer straight to whoever awaits the task
+      struct final_awaiter {
+        bool await_ready() const noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+          const auto next = handle.promise().continuation;
+          return next ? next : std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept {}
+      };
+
+      // Tasks start lazily, when awaited
+      std::suspend_always initial_suspend() const noexcept { return {}; }
+
+      final_awaiter final_suspend() const noexcept { return {}; }
+
+      void unhandled_exception() noexcept { exception = std::current_exception(); }
+    };
+
+    template <typename T> struct task_promise final : task_promise_base {
+      std::optional<T> value;
+
+      task<T> get_return_object() noexcept;
+
+      template <typename U> void return_value(U&& result) {
+        value.emplace(std::forward<U>(result));
+      }
+
+      T result() {
+        if (exception) {
+          std::rethrow_exception(exception);
+        }
+        return std::move(*value);
+      }
+    };
+
+    template <> struct task_promise<void> final : task_promise_base {
+      task<void> get_return_object() noexcept;
+
+      void return_void() const noexcept {}
+
+      void result() const {
+        if (exception) {
+          std::rethrow_exception(exception);
+        }
+      }
+    };
+  } // namespace internal
+
+  // A coroutine producing a T; starts when awaited and resumes the
+  // awaiting coroutine once done
+  //
+  // A task runs on whatever thread resumes it; co_await pool.schedule()
+  // inside moves it onto a pool. No worker is held while a task is
+  // suspended.
+  template <typename T> class [[nodiscard]] task final {
+  public:
+    typedef internal::task_promise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> handle_type;
+
+    task(task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+    task& operator=(task&& rhs) noexcept {
+      task(std::move(rhs)).swap(*this);
+      return *this;
+    }
+
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+
+    ~task() {
+      if (handle_) {
+        handle_.destroy();
+      }
+    }
+
+    void swap(task& other) noexcept { std::swap(handle_, other.handle_); }
+
+    // Start the task and suspend the awaiting coroutine until it is done
+    auto operator co_await() noexcept {
+      struct awaiter {
+        handle_type handle;
+
+        bool await_ready() const noexcept { return handle.done(); }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+          handle.promise().continuation = awaiting;
+          return handle;
+        }
+
+        T await_resume() { return handle.promise().result(); }
+      };
+      return awaiter{handle_};
+    }
+
+  private:
+    friend promise_type;
+
+    explicit task(handle_type handle) noexcept : handle_(handle) {}
+
+    handle_type handle_;
+  };
+
+  namespace internal {
+    template <typename T> task<T> task_promise<T>::get_return_object() noexcept {
+      return task<T>(std::coroutine_handle<task_promise>::from_promise(*this));
+    }
+
+    inline task<void> task_promise<void>::get_return_object() noexcept {
+      return task<void>(std::coroutine_handle<task_promise>::from_promise(*this));
+    }
+
+    // Coroutine sync_wait drives a task with; signals done only after it
+    // suspended for the last time, so the waiting thread may destroy it
+    class sync_wait_driver final {
+    public:
+      struct promise_type {
+        promise<void> done;
+
+        sync_wait_driver get_return_object() noexcept {
+          return sync_wait_driver(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+
+        auto final_suspend() const noexcept {
+          struct signal {
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(std::coroutine_handle<promise_type> handle) const noexcept {
+              // The waiting thread may destroy the frame, and the promise in
+              // it, as soon as it sees the value; set_value() is not done
+              // with the state by then, so it must not be in the frame
+              auto done = std::move(handle.promise().done);
+              done.set_value();
+            }
+
+            void await_resume() const noexcept {}
+          };
+          return signal{};
+        }
+
+        void return_void() const noexcept {}
+
+        // The driver catches everything itself
+        void unhandled_exception() const noexcept { std::terminate(); }
+      };
+
+      sync_wait_driver(const sync_wait_driver&) = delete;
+      sync_wait_driver& operator=(const sync_wait_driver&) = delete;
+
+      ~sync_wait_driver() { handle_.destroy(); }
+
+      // Run until the first suspension and return a future for the end
+      future<void> start() {
+        auto done = handle_.promise().done.get_future();
+        handle_.resume();
+        return done;
+      }
+
+    private:
+      explicit sync_wait_driver(std::coroutine_handle<promise_type> handle) noexcept
+          : handle_(handle) {}
+
+      std::coroutine_handle<promise_type> handle_;
+    };
+
+    // Coroutine spawn starts a task with; runs eagerly and destroys itself
+    // when done, nobody owns it
+    struct detached_coroutine final {
+      struct promise_type {
+        detached_coroutine get_return_object() const noexcept { return {}; }
+
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+
+        std::suspend_never final_suspend() const noexcept { return {}; }
+
+        void return_void() const noexcept {}
+
+        // The body catches everything itself
+        void unhandled_exception() const noexcept { std::terminate(); }
+      };
+    };
+  } // namespace internal
+
+  // Run task to completion and return its result, blocking the calling
+  // thread; on a pool worker, other tasks run while waiting
+  template <typename T> T sync_wait(task<T> awaited) {
+    std::optional<internal::stored_type<T>> value;
+    std::exception_ptr exception;
+
+    auto driver = [](task<T> t, std::optional<internal::stored_type<T>>& result,
+                     std::exception_ptr& error) -> internal::sync_wait_driver {
+      try {
+        if constexpr (std::is_void<T>::value) {
+          co_await t;
+          result.emplace();
+        } else {
+          result.emplace(co_await t);
+        }
+      } catch (...) {
+        error = std::current_exception();
+      }
+    }(std::move(awaited), value, exception);
+    driver.start().get();
+
+    if (exception) {
+      std::rethrow_exception(exception);
+    }
+    if constexpr (!std::is_void<T>::value) {
+      return std::move(*value);
+    }
+  }
+
+  // Start task on pool without awaiting it and return a future for its
+  // result; unlike co_await, many spawned tasks can be in flight at once
+  //
+  // The future's continuations run on pool. If pool is stopped, the future
+  // holds the std::runtime_error of schedule().
+  template <typename T> future<T> spawn(thread_pool& pool, task<T> awaited) {
+    promise<T> result(internal::pool_access::executor(pool));
+    auto started = result.get_future();
+
+    [](thread_pool& p, task<T> t, promise<T> done) -> internal::detached_coroutine {
+      try {
+        co_await p.schedule();
+        if constexpr (std::is_void<T>::value) {
+          co_await t;
+          done.set_value();
+        } else {
+          done.set_value(co_await t);
+        }
+      } catch (...) {
+        done.set_exception(std::current_exception());
+      }
+    }(pool, std::move(awaited), std::move(result));
+    return started;
+  }
+
+  // Lets coroutines co_await a foo::future without blocking; the awaiting
+  // coroutine is resumed on the future's pool once it is ready, or right
+  // where the pool drops the resumption if it stopped meanwhile
+  template <typename T> auto operator co_await(future<T>&& awaited) {
+    struct awaiter {
+      future<T> awaited;
+
+      bool await_ready() const noexcept { return awaited.is_ready(); }
+
+      // See schedule_operation::await_suspend
+      void await_suspend(std::coroutine_handle<> handle) noexcept {
+        internal::future_access::state(awaited)->set_continuation(
+            internal::resumer<std::coroutine_handle<>>(handle, nullptr));
+      }
+
+      T await_resume() { return awaited.get(); }
+    };
+    return awaiter{std::move(awaited)};
+  }
+} // namespace foo
+
+#endif
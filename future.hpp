@@ -0,0 +1,733 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "unique_task.hpp"
+
+namespace foo {
+  template <typename T> class future;
+  template <typename T> class promise;
+
+  namespace internal {
+    // Where continuations run: on a thread_pool, or right away on the thread
+    // that makes the future ready if there is no execute function
+    struct executor_ref {
+      void* context = nullptr;
+      void (*execute)(void* context, unique_task task) = nullptr;
+
+      void operator()(unique_task task) const {
+        if (execute) {
+          execute(context, std::move(task));
+        } else {
+          task();
+        }
+      }
+    };
+
+    // Lets a thread that waits for a future do something useful meanwhile;
+    // thread_pool installs one on its workers that runs a pending task
+    struct wait_helper {
+      void* context = nullptr;
+      // Returns false if there was nothing to do
+      bool (*run_one)(void* context) = nullptr;
+      // Blocks until ready(state) returns true, there may be something to
+      // do, or deadline passed
+      void (*park)(void* context, bool (*ready)(const void* state), const void* state,
+                   std::chrono::steady_clock::time_point deadline) = nullptr;
+      // Has the threads blocked in park check again
+      void (*wake)(void* context) = nullptr;
+
+      explicit operator bool() const noexcept { return run_one != nullptr; }
+    };
+
+    inline thread_local wait_helper this_thread_wait_helper;
+
+    // Stands in for the value of a future<void>
+    struct void_value {};
+
+    template <typename T>
+    using stored_type = std::conditional_t<std::is_void<T>::value, void_value, T>;
+
+    template <typename T, typename Callable> void fulfil(promise<T>& promise, Callable&& call);
+
+    struct future_access;
+
+    // Blocks of one size and alignment recycled per thread: a block freed
+    // on a thread is handed out again by the next allocation on that
+    // thread. Future states are allocated and freed at the rate tasks run,
+    // mostly on workers, so this saves a trip to the global heap each time.
+    template <std::size_t Size, std::size_t Alignment> class block_freelist final {
+    public:
+      // Blocks kept per thread; the rest go back to the heap
+      static constexpr std::size_t capacity = 64;
+
+      static void* allocate() {
+        if (!destroyed_) {
+          auto& list = local();
+          if (list.head_) {
+            block* b = list.head_;
+            list.head_ = b->next;
+            --list.size_;
+            return b;
+          }
+        }
+        return new_block();
+      }
+
+      static void deallocate(void* p) noexcept {
+        if (!destroyed_) {
+          auto& list = local();
+          if (list.size_ < capacity) {
+            list.head_ = ::new (p) block{list.head_};
+            ++list.size_;
+            return;
+          }
+        }
+        delete_block(p);
+      }
+
+      block_freelist(const block_freelist&) = delete;
+      block_freelist& operator=(const block_freelist&) = delete;
+
+    private:
+      struct block {
+        block* next;
+      };
+
+      static constexpr std::size_t block_size = Size < sizeof(block) ? sizeof(block) : Size;
+
+      // Over-aligned blocks come from the aligned operator new
+      static constexpr bool over_aligned = Alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+      static void* new_block() {
+        if constexpr (over_aligned) {
+          return ::operator new(block_size, std::align_val_t(Alignment));
+        } else {
+          return ::operator new(block_size);
+        }
+      }
+
+      static void delete_block(void* p) noexcept {
+        if constexpr (over_aligned) {
+          ::operator delete(p, std::align_val_t(Alignment));
+        } else {
+          ::operator delete(p);
+        }
+      }
+
+      block_freelist() noexcept : head_(nullptr), size_(0) {}
+
+      ~block_freelist() {
+        destroyed_ = true;
+        while (head_) {
+          block* b = head_;
+          head_ = b->next;
+          delete_block(b);
+        }
+      }
+
+      static block_freelist& local() {
+        thread_local block_freelist list;
+        return list;
+      }
+
+      // Set once this thread's list is gone; trivially destructible, so it
+      // can still be read from destructors of other thread_locals
+      static inline thread_local bool destroyed_ = false;
+
+      block* head_;
+      std::size_t size_;
+    };
+
+    // Allocator drawing single objects from block_freelist
+    template <typename T> class recycling_allocator final {
+    public:
+      typedef T value_type;
+
+      recycling_allocator() noexcept = default;
+
+      template <typename U> recycling_allocator(const recycling_allocator<U>&) noexcept {}
+
+      T* allocate(std::size_t n) {
+        if (n == 1) {
+          return static_cast<T*>(block_freelist<sizeof(T), alignof(T)>::allocate());
+        }
+        return std::allocator<T>().allocate(n);
+      }
+
+      void deallocate(T* p, std::size_t n) noexcept {
+        if (n == 1) {
+          block_freelist<sizeof(T), alignof(T)>::deallocate(p);
+        } else {
+          std::allocator<T>().deallocate(p, n);
+        }
+      }
+
+      template <typename U> bool operator==(const recycling_allocator<U>&) const noexcept {
+        return true;
+      }
+
+      template <typename U> bool operator!=(const recycling_allocator<U>&) const noexcept {
+        return false;
+      }
+    };
+
+    // Threads blocked on a future wait on one of a fixed number of mutex and
+    // condition variable pairs, picked by the address of the state. A state
+    // itself is a single atomic word, and nobody locks anything unless
+    // somebody actually blocks.
+    struct parking_lot final {
+      std::mutex mutex;
+      std::condition_variable cond;
+
+      static parking_lot& of(const void* address) {
+        static constexpr std::size_t lot_count = 64;
+        static parking_lot lots[lot_count];
+        const auto key = reinterpret_cast<std::uintptr_t>(address) / alignof(std::max_align_t);
+        return lots[key % lot_count];
+      }
+    };
+
+    // State shared by a promise and its future
+    //
+    // Whether it is ready, has a continuation or a thread waiting is kept in
+    // one atomic. The value lives in the state itself, and states are
+    // allocated with recycling_allocator.
+    template <typename T> class future_state final {
+    public:
+      explicit future_state(executor_ref executor)
+          : flags_(0), helper_(), value_(), exception_(), continuation_(), run_inline_(false),
+            executor_(executor) {}
+
+      future_state(const future_state&) = delete;
+      future_state& operator=(const future_state&) = delete;
+
+      void set_value(stored_type<T> value) {
+        check_unsatisfied();
+        value_.emplace(std::move(value));
+        publish();
+      }
+
+      void set_exception(std::exception_ptr exception) {
+        check_unsatisfied();
+        exception_ = std::move(exception);
+        publish();
+      }
+
+      bool ready() const noexcept {
+        return (flags_.load(std::memory_order_acquire) & ready_flag) != 0;
+      }
+
+      // On a thread with a wait_helper, run other tasks until ready, so a
+      // task waiting for its subtasks cannot starve the pool of workers
+      void wait() const {
+        if (!this_thread_wait_helper) {
+          park_for(std::chrono::steady_clock::duration::max());
+          return;
+        }
+        help_until(std::chrono::steady_clock::time_point::max());
+      }
+
+      template <typename Rep, typename Period>
+      bool wait_for(const std::chrono::duration<Rep, Period>& timeout) const {
+        if (!this_thread_wait_helper) {
+          return park_for(timeout);
+        }
+        return help_until(std::chrono::steady_clock::now() + timeout);
+      }
+
+      // Move the value out or rethrow the exception; must be ready
+      stored_type<T> take() {
+        if (exception_) {
+          std::rethrow_exception(exception_);
+        }
+        return std::move(*value_);
+      }
+
+      // Arrange for continuation to be executed once ready; right away if
+      // ready already. With run_inline, it is called on the thread that makes
+      // the state ready instead, so it had better be short.
+      void set_continuation(unique_task continuation, bool run_inline = false) {
+        continuation_ = std::move(continuation);
+        run_inline_ = run_inline;
+        auto flags = flags_.load(std::memory_order_relaxed);
+        while ((flags & ready_flag) == 0) {
+          // Release continuation_ to whoever makes the state ready
+          if (flags_.compare_exchange_weak(flags, flags | continuation_flag,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+            return;
+          }
+        }
+        run(std::move(continuation_), run_inline);
+      }
+
+      executor_ref executor() const noexcept { return executor_; }
+
+    private:
+      static constexpr std::uint32_t ready_flag = 1;
+      static constexpr std::uint32_t waiting_flag = 2;
+      static constexpr std::uint32_t continuation_flag = 4;
+
+      // Run other tasks through this thread's wait_helper until ready or
+      // deadline passed; returns ready(). In between, the helper parks
+      // where both new tasks and publish() wake it up.
+      bool help_until(std::chrono::steady_clock::time_point deadline) const {
+        const wait_helper helper = this_thread_wait_helper;
+        auto& lot = parking_lot::of(this);
+        while (!ready()) {
+          if (helper.run_one(helper.context)) {
+            continue;
+          }
+          if (std::chrono::steady_clock::now() >= deadline) {
+            return false;
+          }
+          {
+            std::lock_guard<std::mutex> guard(lot.mutex);
+            helper_ = helper;
+            flags_.fetch_or(waiting_flag, std::memory_order_relaxed);
+          }
+          helper.park(helper.context, &is_ready, this, deadline);
+          {
+            // publish() wakes helper_ under the lock, which keeps its
+            // context alive until then
+            std::lock_guard<std::mutex> guard(lot.mutex);
+            helper_ = wait_helper();
+          }
+        }
+        return true;
+      }
+
+      // The helper checks this right after registering itself as parked
+      // and publish() looks for parked helpers right after setting
+      // ready_flag, so both use seq_cst
+      static bool is_ready(const void* state) {
+        return (static_cast<const future_state*>(state)->flags_.load() & ready_flag) != 0;
+      }
+
+      // Block until ready or timeout passed; returns ready()
+      template <typename Rep, typename Period>
+      bool park_for(const std::chrono::duration<Rep, Period>& timeout) const {
+        if (ready()) {
+          return true;
+        }
+        auto& lot = parking_lot::of(this);
+        std::unique_lock<std::mutex> lock(lot.mutex);
+        flags_.fetch_or(waiting_flag, std::memory_order_relaxed);
+        if (timeout == std::chrono::duration<Rep, Period>::max()) {
+          lot.cond.wait(lock, [this] { return ready(); });
+          return true;
+        }
+        return lot.cond.wait_for(lock, timeout, [this] { return ready(); });
+      }
+
+      void check_unsatisfied() const {
+        if (ready()) {
+          throw std::future_error(std::future_errc::promise_already_satisfied);
+        }
+      }
+
+      void publish() {
+        const auto flags = flags_.fetch_or(ready_flag);
+        if (flags & waiting_flag) {
+          // Once we held the lock, every waiter either saw ready or is
+          // blocked on the condition variable
+          auto& lot = parking_lot::of(this);
+          {
+            std::lock_guard<std::mutex> guard(lot.mutex);
+            if (helper_) {
+              helper_.wake(helper_.context);
+            }
+          }
+          lot.cond.notify_all();
+        }
+        if (flags & continuation_flag) {
+          run(std::move(continuation_), run_inline_);
+        }
+      }
+
+      void run(unique_task continuation, bool run_inline) {
+        if (run_inline) {
+          continuation();
+        } else {
+          executor_(std::move(continuation));
+        }
+      }
+
+      mutable std::atomic<std::uint32_t> flags_;
+      // The helper of the thread parked in help_until, if any; guarded by
+      // the mutex of the parking lot
+      mutable wait_helper helper_;
+      std::optional<stored_type<T>> value_;
+      std::exception_ptr exception_;
+      // A future has at most one continuation, since then() consumes it
+      unique_task continuation_;
+      bool run_inline_;
+      const executor_ref executor_;
+    };
+  } // namespace internal
+
+  // A std::future look-alike that can be chained with then() without
+  // blocking a thread; see "C++ Concurrency in Action", 4.4
+  //
+  // Futures returned by thread_pool::submit run their continuations as new
+  // tasks on that pool, so the pool must outlive them.
+  template <typename T> class future final {
+  public:
+    typedef T value_type;
+
+    // Construct a future without state
+    future() noexcept = default;
+
+    future(future&&) noexcept = default;
+    future& operator=(future&&) noexcept = default;
+
+    future(const future&) = delete;
+    future& operator=(const future&) = delete;
+
+    // Returns true if this future refers to a state, that is, get() or
+    // then() have not been called yet
+    bool valid() const noexcept { return static_cast<bool>(state_); }
+
+    // Returns true if get() would not block; a single atomic load
+    bool is_ready() const { return state_ && state_->ready(); }
+
+    void wait() const {
+      check_state();
+      state_->wait();
+    }
+
+    template <typename Rep, typename Period>
+    std::future_status wait_for(const std::chrono::duration<Rep, Period>& timeout) const {
+      check_state();
+      return state_->wait_for(timeout) ? std::future_status::ready : std::future_status::timeout;
+    }
+
+    // Wait for the result and return it, or rethrow the exception stored;
+    // leaves this future invalid
+    T get() {
+      check_state();
+      const auto state = std::move(state_);
+      state->wait();
+      if constexpr (std::is_void<T>::value) {
+        state->take();
+      } else {
+        return state->take();
+      }
+    }
+
+    // Call function(future<T>) once this future is ready, without waiting
+    // for it, and return a future for its result
+    //
+    // The continuation gets the ready future and calls get() on it, so
+    // exceptions propagate down a chain unless a continuation handles them.
+    // It runs as a task on the same pool as this future's. Leaves this
+    // future invalid.
+    template <typename Function>
+    auto then(Function&& function)
+        -> future<std::invoke_result_t<std::decay_t<Function>&, future>> {
+      typedef std::invoke_result_t<std::decay_t<Function>&, future> result_type;
+
+      check_state();
+      auto state = std::move(state_);
+      promise<result_type> next(state->executor());
+      auto result = next.get_future();
+      auto* target = state.get();
+      target->set_continuation([next = std::move(next), function = std::forward<Function>(function),
+                                state = std::move(state)]() mutable {
+        internal::fulfil(next, [&]() -> result_type { return function(future(std::move(state))); });
+      });
+      return result;
+    }
+
+  private:
+    friend class promise<T>;
+    friend struct internal::future_access;
+
+    explicit future(std::shared_ptr<internal::future_state<T>> state) : state_(std::move(state)) {}
+
+    void check_state() const {
+      if (!state_) {
+        throw std::future_error(std::future_errc::no_state);
+      }
+    }
+
+    std::shared_ptr<internal::future_state<T>> state_;
+  };
+
+  static_assert(std::is_nothrow_default_constructible<future<int>>::value);
+  static_assert(!std::is_copy_constructible<future<int>>::value);
+  static_assert(!std::is_copy_assignable<future<int>>::value);
+  static_assert(std::is_nothrow_move_constructible<future<int>>::value);
+  static_assert(std::is_nothrow_move_assignable<future<int>>::value);
+
+  // The producing end of a future<T>
+  template <typename T> class promise final {
+  public:
+    // Construct a promise whose continuations run on the thread that
+    // fulfils it
+    promise() : promise(internal::executor_ref()) {}
+
+    // Construct a promise whose continuations are handed to executor
+    explicit promise(internal::executor_ref executor)
+        : state_(std::allocate_shared<internal::future_state<T>>(
+              internal::recycling_allocator<internal::future_state<T>>(), executor)),
+          retrieved_(false) {}
+
+    promise(promise&& other) noexcept
+        : state_(std::move(other.state_)), retrieved_(other.retrieved_) {}
+
+    promise& operator=(promise&& rhs) noexcept {
+      promise(std::move(rhs)).swap(*this);
+      return *this;
+    }
+
+    promise(const promise&) = delete;
+    promise& operator=(const promise&) = delete;
+
+    // Breaks the promise if it has not been kept
+    ~promise() {
+      if (state_ && !state_->ready()) {
+        try {
+          state_->set_exception(
+              std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+        } catch (...) {
+          // A continuation could not be scheduled; nobody to tell
+        }
+      }
+    }
+
+    void swap(promise& other) noexcept {
+      using std::swap;
+      swap(state_, other.state_);
+      swap(retrieved_, other.retrieved_);
+    }
+
+    // Return the future for this promise; only once
+    future<T> get_future() {
+      check_state();
+      if (retrieved_) {
+        throw std::future_error(std::future_errc::future_already_retrieved);
+      }
+      retrieved_ = true;
+      return future<T>(state_);
+    }
+
+    template <typename U = T, typename = std::enable_if_t<!std::is_void<U>::value>>
+    void set_value(internal::stored_type<U> value) {
+      check_state();
+      state_->set_value(std::move(value));
+    }
+
+    template <typename U = T, typename = std::enable_if_t<std::is_void<U>::value>>
+    void set_value() {
+      check_state();
+      state_->set_value(internal::void_value());
+    }
+
+    void set_exception(std::exception_ptr exception) {
+      check_state();
+      state_->set_exception(std::move(exception));
+    }
+
+  private:
+    void check_state() const {
+      if (!state_) {
+        throw std::future_error(std::future_errc::no_state);
+      }
+    }
+
+    std::shared_ptr<internal::future_state<T>> state_;
+    bool retrieved_;
+  };
+
+  static_assert(std::is_default_constructible<promise<int>>::value);
+  static_assert(!std::is_copy_constructible<promise<int>>::value);
+  static_assert(!std::is_copy_assignable<promise<int>>::value);
+  static_assert(std::is_nothrow_move_constructible<promise<int>>::value);
+  static_assert(std::is_nothrow_move_assignable<promise<int>>::value);
+
+  namespace internal {
+    // Run call and store its result or exception in promise
+    template <typename T, typename Callable> void fulfil(promise<T>& promise, Callable&& call) {
+      try {
+        if constexpr (std::is_void<T>::value) {
+          call();
+          promise.set_value();
+        } else {
+          promise.set_value(call());
+        }
+      } catch (...) {
+        promise.set_exception(std::current_exception());
+      }
+    }
+  } // namespace internal
+
+  namespace internal {
+    // Lets the combinators below get at the state of a future
+    struct future_access {
+      template <typename T>
+      static const std::shared_ptr<future_state<T>>& state(const future<T>& f) {
+        f.check_state();
+        return f.state_;
+      }
+
+      // Executor of the first of several futures, so a combination of
+      // futures from a pool continues on that pool
+      template <typename T, typename... Ts>
+      static executor_ref executor(const future<T>& first, const future<Ts>&...) {
+        return state(first)->executor();
+      }
+    };
+
+    template <typename Sequence> struct when_all_context {
+      when_all_context(Sequence&& sequence, std::size_t count, executor_ref executor)
+          : futures(std::move(sequence)), remaining(count), result(executor) {}
+
+      // Called as each input becomes ready; the last one fulfils result
+      void on_ready() {
+        if (remaining.fetch_sub(1) == 1) {
+          result.set_value(std::move(futures));
+        }
+      }
+
+      Sequence futures;
+      std::atomic<std::size_t> remaining;
+      promise<Sequence> result;
+    };
+  } // namespace internal
+
+  // The result of when_any: all futures passed to it, and the index of the
+  // first one that became ready
+  template <typename Sequence> struct when_any_result {
+    std::size_t index;
+    Sequence futures;
+  };
+
+  // Returns a future that becomes ready once all of futures are, holding
+  // them; see "C++ Concurrency in Action", 4.4.6
+  //
+  // Nothing waits: every input notifies the combined state as it completes,
+  // in O(1). Exceptions stay inside the individual futures.
+  template <typename... Ts>
+  future<std::tuple<future<Ts>...>> when_all(future<Ts>... futures) {
+    typedef std::tuple<future<Ts>...> sequence_type;
+
+    if constexpr (sizeof...(Ts) == 0) {
+      promise<sequence_type> ready;
+      ready.set_value(sequence_type());
+      return ready.get_future();
+    } else {
+      const internal::executor_ref executor = internal::future_access::executor(futures...);
+      std::tuple<std::shared_ptr<internal::future_state<Ts>>...> states(
+          internal::future_access::state(futures)...);
+      auto context = std::make_shared<internal::when_all_context<sequence_type>>(
+          sequence_type(std::move(futures)...), sizeof...(Ts), executor);
+      auto result = context->result.get_future();
+      std::apply(
+          [&context](auto&... state) {
+            (state->set_continuation([context] { context->on_ready(); }, true), ...);
+          },
+          states);
+      return result;
+    }
+  }
+
+  // Returns a future that becomes ready once all futures in [first, last)
+  // are, holding them in a vector; the futures are moved from
+  template <typename InputIt>
+  auto when_all(InputIt first, InputIt last)
+      -> future<std::vector<typename std::iterator_traits<InputIt>::value_type>> {
+    typedef std::vector<typename std::iterator_traits<InputIt>::value_type> sequence_type;
+    typedef typename sequence_type::value_type::value_type value_type;
+
+    sequence_type futures(std::make_move_iterator(first), std::make_move_iterator(last));
+    if (futures.empty()) {
+      promise<sequence_type> ready;
+      ready.set_value(std::move(futures));
+      return ready.get_future();
+    }
+
+    std::vector<std::shared_ptr<internal::future_state<value_type>>> states;
+    states.reserve(futures.size());
+    for (const auto& f : futures) {
+      states.push_back(internal::future_access::state(f));
+    }
+    const auto count = futures.size();
+    auto context = std::make_shared<internal::when_all_context<sequence_type>>(
+        std::move(futures), count, states.front()->executor());
+    auto result = context->result.get_future();
+    for (const auto& state : states) {
+      state->set_continuation([context] { context->on_ready(); }, true);
+    }
+    return result;
+  }
+
+  // Returns a future that becomes ready as soon as one of the futures in
+  // [first, last) is, holding all of them and the index of that one; the
+  // futures are moved from
+  //
+  // For an empty range, the result is ready at once with index -1.
+  template <typename InputIt>
+  auto when_any(InputIt first, InputIt last) -> future<
+      when_any_result<std::vector<typename std::iterator_traits<InputIt>::value_type>>> {
+    typedef std::vector<typename std::iterator_traits<InputIt>::value_type> sequence_type;
+    typedef typename sequence_type::value_type::value_type value_type;
+    typedef when_any_result<sequence_type> result_type;
+
+    struct context_type {
+      context_type(sequence_type&& sequence, internal::executor_ref executor)
+          : futures(std::move(sequence)), done(false), result(executor) {}
+
+      sequence_type futures;
+      std::atomic<bool> done;
+      promise<result_type> result;
+    };
+
+    sequence_type futures(std::make_move_iterator(first), std::make_move_iterator(last));
+    if (futures.empty()) {
+      promise<result_type> ready;
+      ready.set_value(result_type{static_cast<std::size_t>(-1), std::move(futures)});
+      return ready.get_future();
+    }
+
+    // Keep the states apart: the first one to become ready moves futures
+    // away while the rest are still being hooked up
+    std::vector<std::shared_ptr<internal::future_state<value_type>>> states;
+    states.reserve(futures.size());
+    for (const auto& f : futures) {
+      states.push_back(internal::future_access::state(f));
+    }
+    auto context = std::make_shared<context_type>(std::move(futures), states.front()->executor());
+    auto result = context->result.get_future();
+    for (std::size_t i = 0; i < states.size(); ++i) {
+      states[i]->set_continuation(
+          [context, i] {
+            if (!context->done.exchange(true)) {
+              context->result.set_value(result_type{i, std::move(context->futures)});
+            }
+          },
+          true);
+    }
+    return result;
+  }
+
+  // Returns true if f holds a result or exception already
+  template <typename T> bool is_ready(const future<T>& f) { return f.is_ready(); }
+} // namespace foo
@@ -3,14 +3,26 @@
 
 #include <curl/curl.h>
 #include <exception>
-#include <future>
 #include <iostream>
+#include <mutex>
 #include <ostream>
 #include <string>
 #include <vector>
 
 using namespace foo;
 
+namespace {
+  response fetch(const std::string& url) {
+    CURL* handle = curl_easy_init();
+    curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+    curl_easy_perform(handle);
+    response res;
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &res.code);
+    curl_easy_cleanup(handle);
+    return res;
+  }
+} // namespace
+
 int main() {
   std::vector<std::string> urls{
       "example.com",          "google.com",   "otris.de",  "microsoft.com", "amicaldo.de",
@@ -18,24 +30,24 @@ int main() {
 
   curl_global_init(CURL_GLOBAL_DEFAULT);
 
+  // Outlives the pool, and so every continuation using it
+  std::mutex output_mutex;
   thread_pool pool;
-  std::vector<std::future<response>> completed;
 
   try {
+    // Print each status as soon as its request completes
+    std::vector<future<void>> printed;
     for (const auto& url : urls) {
-      completed.push_back(pool.submit([&]() -> response {
-        CURL* handle = curl_easy_init();
-        curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
-        curl_easy_perform(handle);
-        response res;
-        curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &res.code);
-        curl_easy_cleanup(handle);
-        return res;
+      printed.push_back(pool.submit(fetch, url).then([&output_mutex, url](future<response> result) {
+        const long code = result.get().code;
+        std::lock_guard<std::mutex> guard(output_mutex);
+        std::cout << url << ": " << code << std::endl;
       }));
     }
 
-    for (auto& result : completed) {
-      std::cout << result.get().code << std::endl;
+    // Rethrow the first error, if any, once all are done
+    for (auto& done : when_all(printed.begin(), printed.end()).get()) {
+      done.get();
     }
   } catch (std::exception& exc) {
     std::cerr << exc.what() << std::endl;
@@ -0,0 +1,271 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "thread_pool.hpp"
+
+namespace foo {
+  namespace internal {
+    // Shared by all chunks of one parallel algorithm invocation; lives on
+    // the stack of the calling thread, which waits for all chunks
+    class fork_join_state final {
+    public:
+      fork_join_state() : pending_(0), failed_(false), mutex_(), error_() {}
+
+      void fork() { pending_.fetch_add(1, std::memory_order_relaxed); }
+
+      // The last chunk to join wakes the waiting thread; the state may be
+      // gone right after the count dropped, so pool comes from the caller.
+      // seq_cst, since the waiter is parked in pool_access::help_until.
+      static void join(fork_join_state& state, thread_pool& pool) {
+        if (state.pending_.fetch_sub(1) == 1) {
+          pool_access::wake_helpers(pool);
+        }
+      }
+
+      bool done() const { return pending_.load() == 0; }
+
+      // Remember the first exception; other chunks skip their work after
+      // this
+      void fail(std::exception_ptr error) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (!error_) {
+          error_ = std::move(error);
+        }
+        failed_.store(true, std::memory_order_relaxed);
+      }
+
+      bool failed() const { return failed_.load(std::memory_order_relaxed); }
+
+      // Help pool until all forked chunks joined, then rethrow the first
+      // exception, if any
+      void wait(thread_pool& pool) {
+        pool_access::help_until(pool, [this] { return done(); });
+        if (error_) {
+          std::rethrow_exception(error_);
+        }
+      }
+
+      fork_join_state(const fork_join_state&) = delete;
+      fork_join_state& operator=(const fork_join_state&) = delete;
+
+    private:
+      std::atomic<std::size_t> pending_;
+      std::atomic<bool> failed_;
+      std::mutex mutex_;
+      std::exception_ptr error_;
+    };
+
+    // parallel_for passes integral indices and dereferenced iterators
+    template <typename Index, typename Body> void invoke_element(const Body& body, Index i) {
+      if constexpr (std::is_integral<Index>::value) {
+        body(i);
+      } else {
+        body(*i);
+      }
+    }
+
+    // Split [first, last) in halves until it is no longer than grain,
+    // queuing the upper halves and running the remaining lower part here.
+    // Queued halves split themselves further when a worker picks them up.
+    template <typename Index, typename Body>
+    void parallel_for_range(thread_pool& pool, Index first, Index last, std::size_t grain,
+                            const Body& body, fork_join_state& state) {
+      while (static_cast<std::size_t>(last - first) > grain) {
+        const Index middle = first + (last - first) / 2;
+        state.fork();
+        try {
+          pool_access::execute(pool, [&pool, middle, last, grain, &body, &state] {
+            try {
+              parallel_for_range(pool, middle, last, grain, body, state);
+            } catch (...) {
+              state.fail(std::current_exception());
+            }
+            fork_join_state::join(state, pool);
+          });
+        } catch (...) {
+          // Never queued, so it won't join
+          fork_join_state::join(state, pool);
+          throw;
+        }
+        last = middle;
+      }
+
+      if (state.failed()) {
+        return;
+      }
+      for (; first != last; ++first) {
+        invoke_element(body, first);
+      }
+    }
+
+    // What stays the same across all chunks of a parallel_transform_reduce
+    template <typename T, typename Combine, typename Map> struct reduce_context {
+      thread_pool& pool;
+      std::size_t grain;
+      const T& identity;
+      const Combine& combine;
+      const Map& map;
+    };
+
+    // Result of the upper half of a split range, filled in by a worker
+    template <typename T> struct reduce_half {
+      std::optional<T> result;
+      std::exception_ptr error;
+      std::atomic<bool> done{false};
+    };
+
+    // Reduce [first, last) by splitting it in halves down to grain elements
+    // and combining the partial results pairwise on the way back up. The
+    // shape of that tree only depends on the length of the range and the
+    // grain, so the result is the same on every run.
+    template <typename It, typename T, typename Combine, typename Map>
+    T reduce_range(const reduce_context<T, Combine, Map>& context, It first, It last) {
+      if (static_cast<std::size_t>(last - first) <= context.grain) {
+        T result = context.identity;
+        for (; first != last; ++first) {
+          result = context.combine(std::move(result), context.map(*first));
+        }
+        return result;
+      }
+
+      const It middle = first + (last - first) / 2;
+      reduce_half<T> upper;
+      // context may be gone once upper is done, so the task keeps pool apart
+      thread_pool& pool = context.pool;
+      pool_access::execute(pool, [&context, &pool, middle, last, &upper] {
+        try {
+          upper.result.emplace(reduce_range(context, middle, last));
+        } catch (...) {
+          upper.error = std::current_exception();
+        }
+        // seq_cst, see fork_join_state::join
+        upper.done.store(true);
+        pool_access::wake_helpers(pool);
+      });
+
+      std::optional<T> lower;
+      std::exception_ptr lower_error;
+      try {
+        lower.emplace(reduce_range(context, first, middle));
+      } catch (...) {
+        lower_error = std::current_exception();
+      }
+
+      // upper refers to this stack frame, so wait for it even on errors
+      pool_access::help_until(pool, [&upper] { return upper.done.load(); });
+      if (lower_error) {
+        std::rethrow_exception(lower_error);
+      }
+      if (upper.error) {
+        std::rethrow_exception(upper.error);
+      }
+      return context.combine(std::move(*lower), std::move(*upper.result));
+    }
+
+    // Chunk size that gives every worker a few chunks to balance load with
+    inline std::size_t default_grain(const thread_pool& pool, std::size_t count) {
+      return std::max<std::size_t>(1, count / (4 * std::max<std::size_t>(1, pool.size())));
+    }
+  } // namespace internal
+
+  // Run body for every element of [first, last) on pool and wait for it
+  //
+  // first and last are either integers, in which case body gets called
+  // with every index, or random access iterators, in which case body gets
+  // called with every element. The range is split recursively into chunks
+  // of at most grain elements; idle workers steal the larger, not yet split
+  // parts. The calling thread works on the range as well instead of just
+  // blocking. If body throws, remaining chunks are skipped and the first
+  // exception is rethrown here.
+  template <typename Index, typename Body>
+  void parallel_for(thread_pool& pool, Index first, Index last, std::size_t grain,
+                    const Body& body) {
+    if (!(first < last)) {
+      return;
+    }
+
+    internal::fork_join_state state;
+    try {
+      internal::parallel_for_range(pool, first, last, std::max<std::size_t>(1, grain), body,
+                                   state);
+    } catch (...) {
+      state.fail(std::current_exception());
+    }
+    state.wait(pool);
+  }
+
+  // Like parallel_for above, with a grain size picked from the size of the
+  // range and the number of workers
+  template <typename Index, typename Body>
+  void parallel_for(thread_pool& pool, Index first, Index last, const Body& body) {
+    if (!(first < last)) {
+      return;
+    }
+    parallel_for(pool, first, last,
+                 internal::default_grain(pool, static_cast<std::size_t>(last - first)), body);
+  }
+
+  // Returns combine(...combine(combine(identity, map(e0)), map(e1))...)
+  // over all elements of [first, last), computed on pool
+  //
+  // The range is split in halves down to chunks of at most grain elements;
+  // every chunk is folded starting from identity and the partial results
+  // are combined pairwise in a tree, without any shared atomic or mutex.
+  // combine must be associative and identity must be its identity element.
+  // For a given range and grain, the order of combine calls is always the
+  // same, so results of operations that are associative only in theory,
+  // like floating point addition, are reproducible. The calling thread
+  // helps with the work; the first exception is rethrown here.
+  template <typename RandomIt, typename T, typename Combine, typename Map>
+  T parallel_transform_reduce(thread_pool& pool, RandomIt first, RandomIt last,
+                              std::size_t grain, T identity, Combine combine, Map map) {
+    typedef typename std::iterator_traits<RandomIt>::iterator_category category;
+    static_assert(std::is_base_of<std::random_access_iterator_tag, category>::value,
+                  "parallel_transform_reduce requires random access iterators");
+    if (!(first < last)) {
+      return identity;
+    }
+
+    const internal::reduce_context<T, Combine, Map> context{
+        pool, std::max<std::size_t>(1, grain), identity, combine, map};
+    return internal::reduce_range(context, first, last);
+  }
+
+  // Like parallel_transform_reduce above, with a grain size picked from the
+  // size of the range and the number of workers
+  template <typename RandomIt, typename T, typename Combine, typename Map>
+  T parallel_transform_reduce(thread_pool& pool, RandomIt first, RandomIt last, T identity,
+                              Combine combine, Map map) {
+    if (!(first < last)) {
+      return identity;
+    }
+    return parallel_transform_reduce(
+        pool, first, last, internal::default_grain(pool, static_cast<std::size_t>(last - first)),
+        std::move(identity), std::move(combine), std::move(map));
+  }
+
+  // Map every element of range and combine the results; see
+  // parallel_transform_reduce
+  template <typename Range, typename T, typename Map, typename Combine>
+  T parallel_reduce(thread_pool& pool, const Range& range, T identity, Map map, Combine combine) {
+    return parallel_transform_reduce(pool, std::begin(range), std::end(range), std::move(identity),
+                                     std::move(combine), std::move(map));
+  }
+
+  // Combine all elements of range; see parallel_transform_reduce
+  template <typename Range, typename T, typename Combine>
+  T parallel_reduce(thread_pool& pool, const Range& range, T identity, Combine combine) {
+    return parallel_reduce(pool, range, std::move(identity),
+                           [](const auto& element) -> const auto& { return element; },
+                           std::move(combine));
+  }
+} // namespace foo
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "future.hpp"
+#include "thread_pool.hpp"
+#include "unique_task.hpp"
+
+namespace foo {
+  // A directed acyclic graph of tasks, run on a thread_pool
+  //
+  // Nodes are callables; precede(a, b) makes b wait for a. Every node
+  // counts its outstanding predecessors, and the task that brings a count
+  // to zero queues that node on its own worker's local queue, so a chain
+  // tends to stay on one thread.
+  //
+  // A graph can be run again once a run has completed; nodes and edges are
+  // allocated only while building it. It must outlive its runs.
+  class task_graph final {
+  public:
+    typedef std::size_t node_id;
+
+    task_graph()
+        : nodes_(), roots_(), validated_(true), running_(false), pool_(nullptr), pending_(0),
+          failed_(false), error_mutex_(), error_(), completion_() {}
+
+    task_graph(const task_graph&) = delete;
+    task_graph& operator=(const task_graph&) = delete;
+
+    // Add a node that calls function(); function is called once per run
+    template <typename Function> node_id add(Function&& function) {
+      check_idle();
+      nodes_.emplace_back(unique_task(std::forward<Function>(function)));
+      validated_ = false;
+      return nodes_.size() - 1;
+    }
+
+    // Make after wait for before to complete
+    void precede(node_id before, node_id after) {
+      check_idle();
+      if (before >= nodes_.size() || after >= nodes_.size()) {
+        throw std::out_of_range("no such task_graph node");
+      }
+      nodes_[before].successors.push_back(after);
+      ++nodes_[after].predecessors;
+      validated_ = false;
+    }
+
+    std::size_t size() const noexcept { return nodes_.size(); }
+
+    // Run all nodes on pool, respecting their dependencies
+    //
+    // The returned future becomes ready when every node has run. If a node
+    // throws, nodes that have not started yet are skipped and the future
+    // holds the first exception. Throws std::invalid_argument if the graph
+    // has a cycle, std::logic_error if it is running already, and
+    // std::runtime_error if pool is stopped.
+    future<void> run(thread_pool& pool) {
+      if (running_.exchange(true)) {
+        throw std::logic_error("task_graph is running already");
+      }
+
+      promise<void> completion(internal::pool_access::executor(pool));
+      auto result = completion.get_future();
+      try {
+        validate();
+      } catch (...) {
+        running_.store(false);
+        throw;
+      }
+      if (nodes_.empty()) {
+        running_.store(false);
+        completion.set_value();
+        return result;
+      }
+
+      pool_ = &pool;
+      pending_.store(nodes_.size(), std::memory_order_relaxed);
+      failed_.store(false, std::memory_order_relaxed);
+      error_ = nullptr;
+      completion_ = std::move(completion);
+      for (auto& n : nodes_) {
+        n.remaining.store(n.predecessors, std::memory_order_relaxed);
+      }
+      // Until the first root is queued, the run can still be called off
+      try {
+        internal::pool_access::execute(pool, [this, root = roots_.front()] { run_node(root); });
+      } catch (...) {
+        running_.store(false);
+        throw;
+      }
+      for (std::size_t i = 1; i < roots_.size(); ++i) {
+        schedule(roots_[i]);
+      }
+      return result;
+    }
+
+  private:
+    struct node {
+      explicit node(unique_task task)
+          : function(std::move(task)), successors(), predecessors(0), remaining(0) {}
+
+      unique_task function;
+      std::vector<node_id> successors;
+      std::size_t predecessors;
+      // Predecessors yet to complete in the current run
+      std::atomic<std::size_t> remaining;
+    };
+
+    void check_idle() const {
+      if (running_.load()) {
+        throw std::logic_error("task_graph is running");
+      }
+    }
+
+    // Find the roots and make sure there is no cycle (Kahn's algorithm)
+    void validate() {
+      if (validated_) {
+        return;
+      }
+
+      std::vector<std::size_t> remaining(nodes_.size());
+      std::vector<node_id> ready;
+      for (node_id i = 0; i < nodes_.size(); ++i) {
+        remaining[i] = nodes_[i].predecessors;
+        if (remaining[i] == 0) {
+          ready.push_back(i);
+        }
+      }
+      std::vector<node_id> roots(ready);
+
+      std::size_t visited = 0;
+      while (!ready.empty()) {
+        const node_id i = ready.back();
+        ready.pop_back();
+        ++visited;
+        for (const auto successor : nodes_[i].successors) {
+          if (--remaining[successor] == 0) {
+            ready.push_back(successor);
+          }
+        }
+      }
+      if (visited != nodes_.size()) {
+        throw std::invalid_argument("task_graph has a cycle");
+      }
+
+      roots_ = std::move(roots);
+      validated_ = true;
+    }
+
+    // Queue node i. If the pool stopped during the run, fail the run and
+    // skip i right here instead, so the run still completes.
+    void schedule(node_id i) {
+      try {
+        internal::pool_access::execute(*pool_, [this, i] { run_node(i); });
+      } catch (...) {
+        fail(std::current_exception());
+        run_node(i);
+      }
+    }
+
+    void run_node(node_id i) {
+      auto& n = nodes_[i];
+      if (!failed_.load(std::memory_order_relaxed)) {
+        try {
+          n.function();
+        } catch (...) {
+          fail(std::current_exception());
+        }
+      }
+
+      for (const auto successor : n.successors) {
+        if (nodes_[successor].remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          schedule(successor);
+        }
+      }
+      if (pending_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        finish();
+      }
+    }
+
+    void fail(std::exception_ptr error) {
+      std::lock_guard<std::mutex> guard(error_mutex_);
+      if (!error_) {
+        error_ = std::move(error);
+      }
+      failed_.store(true, std::memory_order_relaxed);
+    }
+
+    void finish() {
+      // Take what this run needs before allowing the next one
+      auto completion = std::move(completion_);
+      auto error = std::move(error_);
+      running_.store(false);
+
+      if (error) {
+        completion.set_exception(std::move(error));
+      } else {
+        completion.set_value();
+      }
+    }
+
+    // A deque, so nodes stay put as the graph grows
+    std::deque<node> nodes_;
+    std::vector<node_id> roots_;
+    bool validated_;
+
+    // State of the current run
+    std::atomic<bool> running_;
+    thread_pool* pool_;
+    std::atomic<std::size_t> pending_;
+    std::atomic<bool> failed_;
+    std::mutex error_mutex_;
+    std::exception_ptr error_;
+    promise<void> completion_;
+  };
+
+  static_assert(std::is_default_constructible<task_graph>::value);
+  static_assert(!std::is_copy_constructible<task_graph>::value);
+  static_assert(!std::is_copy_assignable<task_graph>::value);
+} // namespace foo
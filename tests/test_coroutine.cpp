@@ -0,0 +1,152 @@
+#include <coroutine.hpp>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#  include <atomic>
+#  include <chrono>
+#  include <condition_variable>
+#  include <memory>
+#  include <mutex>
+#  include <stdexcept>
+#  include <string>
+#  include <thread>
+#  include <vector>
+
+#  include <catch2/catch.hpp>
+
+using namespace foo;
+
+namespace {
+  task<int> answer() { co_return 42; }
+
+  task<std::thread::id> worker_id(thread_pool& pool) {
+    co_await pool.schedule();
+    co_return std::this_thread::get_id();
+  }
+
+  task<int> add_on_pool(thread_pool& pool, int a, int b) {
+    co_await pool.schedule();
+    const int x = co_await answer();
+    co_return x + a + b;
+  }
+
+  task<> fail(thread_pool& pool) {
+    co_await pool.schedule();
+    throw std::runtime_error("oops");
+  }
+
+  task<std::string> await_future(thread_pool& pool) {
+    const int value = co_await pool.submit([] { return 7; });
+    co_return std::to_string(value);
+  }
+
+  task<> count(thread_pool& pool, std::atomic<int>& counter) {
+    co_await pool.schedule();
+    ++counter;
+  }
+
+  // Awaits its children one after the other, each hopping onto the pool
+  task<> await_in_turn(thread_pool& pool, std::atomic<int>& counter, int n) {
+    std::vector<task<>> children;
+    for (int i = 0; i < n; ++i) {
+      children.push_back(count(pool, counter));
+    }
+    for (auto& child : children) {
+      co_await child;
+    }
+  }
+
+  // Suspends on the pool until gate is ready
+  task<int> wait_for_gate(thread_pool& pool, future<void> gate, std::atomic<int>& started,
+                          int id) {
+    co_await pool.schedule();
+    ++started;
+    co_await std::move(gate);
+    co_return id;
+  }
+
+  task<> hop(thread_pool& pool, std::atomic<bool>& suspending) {
+    auto operation = pool.schedule();
+    suspending = true;
+    co_await operation;
+  }
+
+  TEST_CASE("coroutines") {
+    thread_pool pool;
+
+    SECTION("sync_wait") { CHECK(sync_wait(answer()) == 42); }
+
+    SECTION("schedule") {
+      CHECK(sync_wait(worker_id(pool)) != std::this_thread::get_id());
+      CHECK(sync_wait(add_on_pool(pool, 1, 2)) == 45);
+    }
+
+    SECTION("exception") { CHECK_THROWS_AS(sync_wait(fail(pool)), std::runtime_error); }
+
+    SECTION("await future") { CHECK(sync_wait(await_future(pool)) == "7"); }
+
+    SECTION("pool stops before resuming") {
+      thread_pool_options options;
+      options.thread_count = 1;
+      auto stopping = std::make_unique<thread_pool>(options);
+      // Keeps the only worker busy until the pool stops
+      stopping->post([] {
+        std::mutex mutex;
+        std::condition_variable_any cond;
+        std::unique_lock<std::mutex> lock(mutex);
+        interruptible_wait(cond, lock, [] { return false; });
+      });
+
+      // Whether the pool stops before or after the resumption got queued,
+      // the coroutine must end, with an exception
+      std::atomic<bool> suspending(false);
+      std::atomic<bool> threw(false);
+      std::thread waiter([&] {
+        try {
+          sync_wait(hop(*stopping, suspending));
+        } catch (const std::runtime_error&) {
+          threw = true;
+        }
+      });
+      while (!suspending) {
+        std::this_thread::yield();
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      stopping.reset();
+      waiter.join();
+      CHECK(threw);
+    }
+
+    SECTION("spawn") {
+      // All children are suspended at the same time; awaited in turn, the
+      // first would wait for a gate opened only after all started
+      const int n = 100;
+      std::atomic<int> started(0);
+      std::vector<promise<void>> gates(n);
+      std::vector<future<int>> children;
+      for (int i = 0; i < n; ++i) {
+        children.push_back(spawn(pool, wait_for_gate(pool, gates[i].get_future(), started, i)));
+      }
+      while (started < n) {
+        std::this_thread::yield();
+      }
+      for (auto& gate : gates) {
+        gate.set_value();
+      }
+
+      auto all = when_all(children.begin(), children.end()).get();
+      for (int i = 0; i < n; ++i) {
+        CHECK(all[i].get() == i);
+      }
+      CHECK_THROWS_AS(spawn(pool, fail(pool)).get(), std::runtime_error);
+    }
+
+    SECTION("many awaited in turn") {
+      std::atomic<int> counter(0);
+      sync_wait(await_in_turn(pool, counter, 1000));
+      CHECK(counter == 1000);
+    }
+  }
+} // namespace
+
+#endif
@@ -0,0 +1,220 @@
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <thread_pool.hpp>
+
+using namespace foo;
+
+namespace {
+  TEST_CASE("future") {
+
+    SECTION("promise") {
+      promise<int> p;
+      auto f = p.get_future();
+      CHECK(f.valid());
+      CHECK(!f.is_ready());
+      CHECK_THROWS_AS(p.get_future(), std::future_error);
+
+      p.set_value(42);
+      CHECK(f.is_ready());
+      CHECK(f.get() == 42);
+      CHECK(!f.valid());
+      CHECK_THROWS_AS(p.set_value(1), std::future_error);
+    }
+
+    SECTION("broken promise") {
+      future<void> f;
+      {
+        promise<void> p;
+        f = p.get_future();
+      }
+      CHECK_THROWS_AS(f.get(), std::future_error);
+    }
+
+    SECTION("wait from another thread") {
+      promise<int> p;
+      auto f = p.get_future();
+      CHECK(f.wait_for(std::chrono::milliseconds(1)) == std::future_status::timeout);
+      std::thread producer([&p] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        p.set_value(42);
+      });
+      f.wait();
+      CHECK(f.is_ready());
+      CHECK(f.get() == 42);
+      producer.join();
+    }
+
+    SECTION("wait on a worker") {
+      // The worker helps while it waits; it parks once there is nothing to
+      // help with and must still wake up for the value
+      thread_pool_options options;
+      options.thread_count = 1;
+      thread_pool pool(options);
+      promise<int> p;
+      auto f = p.get_future();
+      auto waiter = pool.submit([&f] {
+        f.wait_for(std::chrono::milliseconds(1));
+        return f.get();
+      });
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      p.set_value(42);
+      CHECK(waiter.get() == 42);
+    }
+
+    SECTION("states are recycled") {
+      typedef internal::block_freelist<48, alignof(std::max_align_t)> freelist;
+      void* block = freelist::allocate();
+      freelist::deallocate(block);
+      CHECK(freelist::allocate() == block);
+      freelist::deallocate(block);
+    }
+
+    SECTION("over-aligned values") {
+      struct alignas(64) wide {
+        int value;
+      };
+      thread_pool pool;
+      for (int i = 0; i < 3; ++i) {
+        auto f = pool.submit([i] { return wide{i}; });
+        const wide w = f.get();
+        CHECK(w.value == i);
+      }
+      typedef internal::block_freelist<64, 64> freelist;
+      void* block = freelist::allocate();
+      CHECK(reinterpret_cast<std::uintptr_t>(block) % 64 == 0);
+      freelist::deallocate(block);
+    }
+
+    SECTION("then without executor runs inline") {
+      promise<int> p;
+      auto f = p.get_future().then([](future<int> value) { return value.get() * 2; });
+      CHECK(!f.is_ready());
+      p.set_value(21);
+      CHECK(f.is_ready());
+      CHECK(f.get() == 42);
+    }
+
+    SECTION("then on pool") {
+      // One worker is enough; nothing waits for the chain
+      thread_pool_options options;
+      options.thread_count = 1;
+      thread_pool pool(options);
+      std::promise<void> release;
+      auto released = release.get_future().share();
+      auto chained = pool.submit([released] {
+                           released.wait();
+                           return 1;
+                         })
+                         .then([](future<int> value) { return value.get() + 1; })
+                         .then([](future<int> value) { return std::to_string(value.get()); });
+      CHECK(!chained.is_ready());
+      release.set_value();
+      CHECK(chained.get() == "2");
+    }
+
+    SECTION("then on ready future") {
+      thread_pool pool;
+      auto first = pool.submit([] { return 1; });
+      first.wait();
+      CHECK(first.then([](future<int> value) { return value.get() + 1; }).get() == 2);
+    }
+
+    SECTION("exceptions propagate") {
+      thread_pool pool;
+      std::atomic<bool> called(false);
+      auto chained = pool.submit([]() -> int { throw std::runtime_error("oops"); })
+                         .then([&called](future<int> value) {
+                           called = true;
+                           return value.get() + 1;
+                         })
+                         .then([](future<int> value) {
+                           try {
+                             return value.get();
+                           } catch (const std::runtime_error&) {
+                             return -1;
+                           }
+                         });
+      CHECK(chained.get() == -1);
+      CHECK(called);
+    }
+  }
+
+  TEST_CASE("when_all") {
+
+    SECTION("variadic") {
+      promise<int> first;
+      promise<std::string> second;
+      auto all = when_all(first.get_future(), second.get_future());
+      first.set_value(1);
+      CHECK(!all.is_ready());
+      second.set_exception(std::make_exception_ptr(std::runtime_error("oops")));
+      REQUIRE(all.is_ready());
+
+      auto results = all.get();
+      CHECK(std::get<0>(results).get() == 1);
+      CHECK_THROWS_AS(std::get<1>(results).get(), std::runtime_error);
+    }
+
+    SECTION("empty") {
+      CHECK(when_all().is_ready());
+      std::vector<future<int>> none;
+      CHECK(when_all(none.begin(), none.end()).get().empty());
+    }
+
+    SECTION("range on pool") {
+      thread_pool pool;
+      std::vector<future<int>> futures;
+      for (int i = 0; i < 100; ++i) {
+        futures.push_back(pool.submit([i] { return i; }));
+      }
+      auto total = when_all(futures.begin(), futures.end()).then([](auto all) {
+        int sum = 0;
+        for (auto& f : all.get()) {
+          sum += f.get();
+        }
+        return sum;
+      });
+      CHECK(total.get() == 4950);
+    }
+  }
+
+  TEST_CASE("when_any") {
+
+    SECTION("first ready wins") {
+      std::vector<promise<int>> promises(3);
+      std::vector<future<int>> futures;
+      for (auto& p : promises) {
+        futures.push_back(p.get_future());
+      }
+      auto any = when_any(futures.begin(), futures.end());
+      CHECK(!any.is_ready());
+      promises[2].set_value(2);
+      promises[0].set_value(0);
+
+      auto result = any.get();
+      CHECK(result.index == 2);
+      REQUIRE(result.futures.size() == 3);
+      CHECK(result.futures[2].get() == 2);
+      CHECK(result.futures[0].get() == 0);
+      promises[1].set_value(1);
+      CHECK(result.futures[1].get() == 1);
+    }
+
+    SECTION("empty") {
+      std::vector<future<int>> none;
+      auto result = when_any(none.begin(), none.end()).get();
+      CHECK(result.index == static_cast<std::size_t>(-1));
+      CHECK(result.futures.empty());
+    }
+  }
+} // namespace
@@ -0,0 +1,161 @@
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <parallel.hpp>
+#include <response.hpp>
+
+using namespace foo;
+
+namespace {
+  // Call use(pool) from a task of a one-worker pool while that pool stops
+  template <typename Function> void use_while_stopping(Function use) {
+    thread_pool_options options;
+    options.thread_count = 1;
+    thread_pool pool(options);
+    std::atomic<bool> waiting(false);
+    pool.post([&pool, &waiting, use] {
+      std::mutex mutex;
+      std::condition_variable_any cond;
+      std::unique_lock<std::mutex> lock(mutex);
+      waiting = true;
+      try {
+        interruptible_wait(cond, lock, [] { return false; });
+      } catch (const thread_interrupted&) {
+        // Only the destructor below interrupts the worker
+        use(pool);
+      }
+    });
+    while (!waiting) {
+      std::this_thread::yield();
+    }
+  }
+
+  TEST_CASE("parallel_for") {
+    thread_pool pool;
+
+    SECTION("indices") {
+      std::vector<int> values(100000, 0);
+      parallel_for(pool, std::size_t(0), values.size(), 128,
+                   [&](std::size_t i) { values[i] = static_cast<int>(i); });
+      std::vector<int> expected(values.size());
+      std::iota(expected.begin(), expected.end(), 0);
+      CHECK(values == expected);
+    }
+
+    SECTION("iterators") {
+      std::vector<int> values(1000);
+      std::iota(values.begin(), values.end(), 0);
+      std::atomic<long> sum(0);
+      parallel_for(pool, values.begin(), values.end(), [&](int value) { sum += value; });
+      CHECK(sum == 999L * 1000L / 2);
+    }
+
+    SECTION("empty range") {
+      bool called = false;
+      parallel_for(pool, 5, 5, [&](int) { called = true; });
+      parallel_for(pool, 5, 3, [&](int) { called = true; });
+      CHECK(!called);
+    }
+
+    SECTION("nested") {
+      std::atomic<int> count(0);
+      parallel_for(pool, 0, 16, 1, [&](int) {
+        parallel_for(pool, 0, 100, 8, [&](int) { ++count; });
+      });
+      CHECK(count == 1600);
+    }
+
+    SECTION("exception") {
+      CHECK_THROWS_AS(parallel_for(pool, 0, 10000, 10,
+                                   [](int i) {
+                                     if (i == 5000) {
+                                       throw std::runtime_error("oops");
+                                     }
+                                   }),
+                      std::runtime_error);
+    }
+  }
+
+  TEST_CASE("parallel_reduce") {
+    thread_pool pool;
+
+    SECTION("sum") {
+      std::vector<long> values(100000);
+      std::iota(values.begin(), values.end(), 1L);
+      CHECK(parallel_reduce(pool, values, 0L, [](long a, long b) { return a + b; }) ==
+            100000L * 100001L / 2);
+    }
+
+    SECTION("map") {
+      std::vector<response> responses(1000);
+      for (std::size_t i = 0; i < responses.size(); ++i) {
+        responses[i].code = i % 4 == 0 ? 404 : 200;
+      }
+      const auto not_found = parallel_reduce(
+          pool, responses, 0, [](const response& r) { return r.code == 404 ? 1 : 0; },
+          [](int a, int b) { return a + b; });
+      CHECK(not_found == 250);
+    }
+
+    SECTION("order is preserved") {
+      std::vector<int> values(500);
+      std::iota(values.begin(), values.end(), 0);
+      std::string expected;
+      for (int value : values) {
+        expected += std::to_string(value) + ",";
+      }
+
+      const auto joined = parallel_transform_reduce(
+          pool, values.begin(), values.end(), 7, std::string(),
+          [](const std::string& a, const std::string& b) { return a + b; },
+          [](int value) { return std::to_string(value) + ","; });
+      CHECK(joined == expected);
+    }
+
+    SECTION("empty range") {
+      std::vector<int> values;
+      CHECK(parallel_reduce(pool, values, 42, [](int a, int b) { return a + b; }) == 42);
+    }
+
+    SECTION("exception") {
+      std::vector<int> values(10000, 1);
+      CHECK_THROWS_AS(parallel_reduce(pool, values, 0,
+                                      [](int a, int b) {
+                                        if (a + b > 5000) {
+                                          throw std::runtime_error("oops");
+                                        }
+                                        return a + b;
+                                      }),
+                      std::runtime_error);
+    }
+  }
+
+  TEST_CASE("parallel algorithms on a stopped pool") {
+    std::atomic<int> threw(0);
+    use_while_stopping([&threw](thread_pool& pool) {
+      try {
+        parallel_for(pool, 0, 100, 1, [](int) {});
+      } catch (const std::runtime_error&) {
+        ++threw;
+      }
+      try {
+        std::vector<int> values(100, 1);
+        parallel_transform_reduce(
+            pool, values.begin(), values.end(), 1, 0, [](int a, int b) { return a + b; },
+            [](int value) { return value; });
+      } catch (const std::runtime_error&) {
+        ++threw;
+      }
+    });
+    CHECK(threw == 2);
+  }
+
+} // namespace
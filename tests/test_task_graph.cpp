@@ -0,0 +1,125 @@
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <task_graph.hpp>
+
+using namespace foo;
+
+namespace {
+  // Call use(pool) from a task of a one-worker pool while that pool stops
+  template <typename Function> void use_while_stopping(Function use) {
+    thread_pool_options options;
+    options.thread_count = 1;
+    thread_pool pool(options);
+    std::atomic<bool> waiting(false);
+    pool.post([&pool, &waiting, use] {
+      std::mutex mutex;
+      std::condition_variable_any cond;
+      std::unique_lock<std::mutex> lock(mutex);
+      waiting = true;
+      try {
+        interruptible_wait(cond, lock, [] { return false; });
+      } catch (const thread_interrupted&) {
+        // Only the destructor below interrupts the worker
+        use(pool);
+      }
+    });
+    while (!waiting) {
+      std::this_thread::yield();
+    }
+  }
+
+  TEST_CASE("task_graph") {
+    thread_pool pool;
+    task_graph graph;
+
+    SECTION("empty") { CHECK_NOTHROW(graph.run(pool).get()); }
+
+    SECTION("dependencies") {
+      // fetch pages, parse each, merge, write
+      constexpr int pages = 8;
+      std::atomic<int> fetched(0);
+      std::atomic<int> parsed(0);
+      std::vector<int> sizes(pages, 0);
+      int merged = 0;
+      bool written = false;
+      bool ordered = true;
+
+      const auto merge = graph.add([&] {
+        ordered = ordered && parsed == pages;
+        for (const auto size : sizes) {
+          merged += size;
+        }
+      });
+      const auto write = graph.add([&] { written = merged == pages * 10; });
+      graph.precede(merge, write);
+      for (int i = 0; i < pages; ++i) {
+        const auto fetch = graph.add([&] { ++fetched; });
+        const auto parse = graph.add([&, i] {
+          sizes[i] = 10;
+          ++parsed;
+        });
+        graph.precede(fetch, parse);
+        graph.precede(parse, merge);
+      }
+      CHECK(graph.size() == 2 + 2 * pages);
+
+      graph.run(pool).get();
+      CHECK(fetched == pages);
+      CHECK(ordered);
+      CHECK(written);
+    }
+
+    SECTION("reusable") {
+      std::atomic<int> runs(0);
+      const auto first = graph.add([&runs] { ++runs; });
+      const auto second = graph.add([&runs] { ++runs; });
+      graph.precede(first, second);
+      for (int i = 0; i < 10; ++i) {
+        graph.run(pool).get();
+      }
+      CHECK(runs == 20);
+    }
+
+    SECTION("exception skips dependents") {
+      bool ran = false;
+      const auto failing = graph.add([] { throw std::runtime_error("oops"); });
+      const auto dependent = graph.add([&ran] { ran = true; });
+      graph.precede(failing, dependent);
+      CHECK_THROWS_AS(graph.run(pool).get(), std::runtime_error);
+      CHECK(!ran);
+    }
+
+    SECTION("cycle") {
+      const auto a = graph.add([] {});
+      const auto b = graph.add([] {});
+      graph.precede(a, b);
+      graph.precede(b, a);
+      CHECK_THROWS_AS(graph.run(pool), std::invalid_argument);
+      CHECK_THROWS_AS(graph.precede(a, 2), std::out_of_range);
+    }
+
+    SECTION("stopped pool") {
+      std::atomic<int> runs(0);
+      graph.add([&runs] { ++runs; });
+      std::atomic<bool> threw(false);
+      use_while_stopping([&graph, &threw](thread_pool& stopping) {
+        try {
+          graph.run(stopping);
+        } catch (const std::runtime_error&) {
+          threw = true;
+        }
+      });
+      CHECK(threw);
+
+      // The failed run did not leave the graph running
+      graph.run(pool).get();
+      CHECK(runs == 1);
+    }
+  }
+} // namespace
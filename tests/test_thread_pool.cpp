@@ -0,0 +1,791 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <parallel.hpp>
+#include <task_graph.hpp>
+#include <thread_pool.hpp>
+
+using namespace foo;
+
+namespace {
+  // Polls pred for up to a few seconds; for checks that depend on timing
+  template <typename Predicate> bool eventually(Predicate pred) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!pred()) {
+      if (std::chrono::steady_clock::now() > deadline) {
+        return false;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+  }
+
+  TEST_CASE("thread_pool") {
+
+    SECTION("submit") {
+      thread_pool pool;
+      auto result = pool.submit([](int a, int b) { return a + b; }, 20, 22);
+      CHECK(result.get() == 42);
+    }
+
+    SECTION("many tasks") {
+      thread_pool pool;
+      std::vector<future<int>> results;
+      for (int i = 0; i < 1000; ++i) {
+        results.push_back(pool.submit([i] { return i; }));
+      }
+
+      int sum = 0;
+      for (auto& result : results) {
+        sum += result.get();
+      }
+      CHECK(sum == 999 * 1000 / 2);
+    }
+
+    SECTION("submit from worker") {
+      thread_pool pool;
+      std::atomic<int> count(0);
+      auto outer = pool.submit([&] {
+        std::vector<future<void>> inner;
+        for (int i = 0; i < 100; ++i) {
+          inner.push_back(pool.submit([&] { ++count; }));
+        }
+        return inner;
+      });
+
+      for (auto& f : outer.get()) {
+        f.get();
+      }
+      CHECK(count == 100);
+    }
+
+    SECTION("wait for subtasks on worker") {
+      thread_pool_options options;
+      options.thread_count = 2;
+      thread_pool pool(options);
+
+      // Far more tasks wait at once than there are workers
+      std::function<int(int)> sum_leaves = [&](int depth) {
+        if (depth == 0) {
+          return 1;
+        }
+        auto left = pool.submit(sum_leaves, depth - 1);
+        auto right = pool.submit(sum_leaves, depth - 1);
+        return left.get() + right.get();
+      };
+      CHECK(pool.submit(sum_leaves, 8).get() == 256);
+    }
+
+    SECTION("options") {
+      thread_pool_options options;
+      options.thread_count = 3;
+      options.policy = queue_policy::fifo;
+      options.stack_size = 256 * 1024;
+      options.thread_name_prefix = "test-worker-";
+      thread_pool pool(options);
+      CHECK(pool.size() == 3);
+      CHECK(pool.submit([] { return 1; }).get() == 1);
+    }
+
+    SECTION("affinity") {
+      CHECK(internal::parse_cpu_list("0-2,5,7-8") == std::vector<unsigned int>{0, 1, 2, 5, 7, 8});
+
+      // Two packages of two cores with two hardware threads each; the
+      // siblings of CPU n are n and n + 4
+      std::vector<internal::cpu_info> cpus;
+      for (unsigned int id = 0; id < 8; ++id) {
+        const unsigned int thread = id % 4;
+        cpus.push_back({id, static_cast<int>(thread / 2), static_cast<int>(thread % 2), id / 4});
+      }
+      CHECK(internal::placement_order(cpus, affinity_policy::none).empty());
+      CHECK(internal::placement_order(cpus, affinity_policy::compact) ==
+            std::vector<unsigned int>{0, 4, 1, 5, 2, 6, 3, 7});
+      CHECK(internal::placement_order(cpus, affinity_policy::scatter) ==
+            std::vector<unsigned int>{0, 2, 1, 3, 4, 6, 5, 7});
+      CHECK(internal::placement_order(cpus, affinity_policy::skip_smt) ==
+            std::vector<unsigned int>{0, 1, 2, 3});
+
+#if defined(__linux__)
+      thread_pool_options options;
+      options.thread_count = 2;
+      options.affinity = affinity_policy::compact;
+      thread_pool pool(options);
+      auto allowed = pool.submit([] {
+        cpu_set_t set;
+        sched_getaffinity(0, sizeof(set), &set);
+        return CPU_COUNT(&set);
+      });
+      CHECK(allowed.get() == 1);
+#endif
+    }
+
+    SECTION("numa") {
+      std::vector<internal::cpu_info> cpus;
+      for (unsigned int id = 0; id < 4; ++id) {
+        cpus.push_back({id, 0, static_cast<int>(id), 0, id % 2 == 0 ? 0 : 2});
+      }
+      CHECK(internal::numa_nodes(cpus) ==
+            std::vector<std::vector<unsigned int>>{{0, 2}, {1, 3}});
+
+      thread_pool_options options;
+      options.thread_count = 4;
+      options.numa_aware = true;
+      thread_pool pool(options);
+      REQUIRE(pool.node_count() >= 1);
+
+      std::vector<future<int>> results;
+      for (unsigned int node = 0; node <= pool.node_count(); ++node) {
+        results.push_back(pool.submit(node_hint{node}, [node] { return static_cast<int>(node); }));
+      }
+      for (unsigned int node = 0; node < results.size(); ++node) {
+        CHECK(results[node].get() == static_cast<int>(node));
+      }
+
+      std::atomic<bool> posted(false);
+      pool.post(node_hint{0}, [&posted] { posted = true; });
+      CHECK(eventually([&] { return posted.load(); }));
+    }
+
+    SECTION("default thread count") {
+      CHECK(default_thread_count() >= 1);
+      thread_pool pool;
+      CHECK(pool.size() == default_thread_count());
+    }
+
+    SECTION("elastic") {
+      thread_pool_options options;
+      options.thread_count = 1;
+      options.max_thread_count = 4;
+      options.keep_alive = std::chrono::milliseconds(20);
+      options.grow_queue_depth = 1;
+      options.grow_queue_wait = std::chrono::milliseconds(1);
+      thread_pool pool(options);
+      CHECK(pool.size() == 1);
+
+      std::promise<void> release;
+      std::shared_future<void> released = release.get_future().share();
+      std::vector<future<void>> blocked;
+      for (int i = 0; i < 4; ++i) {
+        blocked.push_back(pool.submit([released] { released.wait(); }));
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      }
+      CHECK(eventually([&] { return pool.high_water_mark() > 1; }));
+      CHECK(pool.high_water_mark() <= 4);
+
+      release.set_value();
+      for (auto& f : blocked) {
+        f.get();
+      }
+      CHECK(eventually([&] { return pool.size() == 1; }));
+    }
+
+    SECTION("submit_bulk") {
+      thread_pool pool;
+      std::vector<int> numbers(100);
+      std::iota(numbers.begin(), numbers.end(), 0);
+      auto results = pool.submit_bulk(numbers.begin(), numbers.end(), [](int i) { return i * 2; });
+      REQUIRE(results.size() == numbers.size());
+      for (std::size_t i = 0; i < results.size(); ++i) {
+        CHECK(results[i].get() == numbers[i] * 2);
+      }
+
+      std::vector<std::function<int()>> callables;
+      for (int i = 0; i < 10; ++i) {
+        callables.push_back([i] { return i; });
+      }
+      auto more = pool.submit_bulk(std::move(callables));
+      REQUIRE(more.size() == 10);
+      for (int i = 0; i < 10; ++i) {
+        CHECK(more[i].get() == i);
+      }
+
+      CHECK(pool.submit_bulk(std::vector<std::function<void()>>()).empty());
+    }
+
+    SECTION("priorities") {
+      thread_pool_options options;
+      options.thread_count = 1;
+      options.priority_aging = std::chrono::milliseconds(0);
+      thread_pool pool(options);
+
+      // Keep the only worker busy while queuing the other tasks
+      std::promise<void> release;
+      std::shared_future<void> released = release.get_future().share();
+      auto blocker = pool.submit([released] { released.wait(); });
+
+      std::mutex mutex;
+      std::vector<task_priority> order;
+      const auto record = [&](task_priority priority) {
+        std::lock_guard<std::mutex> guard(mutex);
+        order.push_back(priority);
+      };
+      std::vector<future<void>> done;
+      done.push_back(pool.submit(task_priority::background, record, task_priority::background));
+      done.push_back(pool.submit(task_priority::normal, record, task_priority::normal));
+      done.push_back(pool.submit(task_priority::high, record, task_priority::high));
+
+      release.set_value();
+      blocker.get();
+      for (auto& f : done) {
+        f.get();
+      }
+      CHECK(order == std::vector<task_priority>{task_priority::high, task_priority::normal,
+                                                task_priority::background});
+      CHECK(pool.queue_wait(task_priority::high).tasks == 1);
+      CHECK(pool.queue_wait(task_priority::normal).tasks == 2);
+      CHECK(pool.queue_wait(task_priority::background).tasks == 1);
+      CHECK(pool.queue_wait(task_priority::background).max >=
+            pool.queue_wait(task_priority::high).max);
+    }
+
+    SECTION("background after stealing") {
+      thread_pool_options options;
+      options.thread_count = 1;
+      options.priority_aging = std::chrono::milliseconds(0);
+      thread_pool pool(options);
+
+      // The only worker queues tasks of its own, then blocks; they are up
+      // for stealing and must go before a queued background task
+      std::mutex mutex;
+      std::vector<task_priority> order;
+      const auto record = [&](task_priority priority) {
+        std::lock_guard<std::mutex> guard(mutex);
+        order.push_back(priority);
+      };
+      std::promise<void> posted;
+      std::promise<void> release;
+      std::shared_future<void> released = release.get_future().share();
+      auto blocker = pool.submit([&, released] {
+        for (int i = 0; i < 2; ++i) {
+          pool.post([&] { record(task_priority::normal); });
+        }
+        posted.set_value();
+        released.wait();
+      });
+      posted.get_future().wait();
+      auto background = pool.submit(task_priority::background, record, task_priority::background);
+
+      CHECK(pool.run_pending_task());
+      CHECK(pool.run_pending_task());
+      {
+        std::lock_guard<std::mutex> guard(mutex);
+        CHECK(order == std::vector<task_priority>{task_priority::normal, task_priority::normal});
+      }
+      release.set_value();
+      blocker.get();
+      background.get();
+      CHECK(order.size() == 3);
+    }
+
+    SECTION("priority aging") {
+      thread_pool_options options;
+      options.thread_count = 1;
+      options.priority_aging = std::chrono::milliseconds(1);
+      thread_pool pool(options);
+
+      // With a steady stream of high priority work, a background task
+      // still gets to run once it aged enough
+      std::atomic<bool> background_ran(false);
+      auto background = pool.submit(task_priority::background, [&] { background_ran = true; });
+      for (int i = 0; i < 2000 && !background_ran; ++i) {
+        pool.submit(task_priority::high, [] {
+              std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }).get();
+        pool.submit(task_priority::high, [] {});
+      }
+      background.get();
+      CHECK(background_ran);
+    }
+
+    SECTION("deadlines") {
+      thread_pool_options options;
+      options.thread_count = 1;
+      thread_pool pool(options);
+
+      std::promise<void> release;
+      std::shared_future<void> released = release.get_future().share();
+      std::atomic<bool> blocking(false);
+      auto blocker = pool.submit([released, &blocking] {
+        blocking = true;
+        released.wait();
+      });
+      REQUIRE(eventually([&] { return blocking.load(); }));
+
+      const auto now = std::chrono::steady_clock::now();
+      std::mutex mutex;
+      std::vector<int> order;
+      const auto record = [&](int value) {
+        std::lock_guard<std::mutex> guard(mutex);
+        order.push_back(value);
+        return value;
+      };
+      auto late = pool.submit(now + std::chrono::hours(2), record, 2);
+      auto early = pool.submit(now + std::chrono::hours(1), record, 1);
+      auto expired = pool.submit(now + std::chrono::milliseconds(1), record, 0);
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+      release.set_value();
+      blocker.get();
+      CHECK_THROWS_AS(expired.get(), deadline_exceeded);
+      CHECK(early.get() == 1);
+      CHECK(late.get() == 2);
+      CHECK(order == std::vector<int>{1, 2});
+    }
+
+    SECTION("post") {
+      thread_pool pool;
+      std::atomic<int> sum(0);
+      for (int i = 1; i <= 100; ++i) {
+        pool.post([&sum](int value) { sum += value; }, i);
+      }
+      CHECK(eventually([&] { return sum == 5050; }));
+    }
+
+    SECTION("exception handler") {
+      std::mutex mutex;
+      std::vector<std::string> errors;
+      thread_pool_options options;
+      options.exception_handler = [&](std::exception_ptr error) {
+        try {
+          std::rethrow_exception(error);
+        } catch (const std::exception& e) {
+          std::lock_guard<std::mutex> guard(mutex);
+          errors.emplace_back(e.what());
+        }
+      };
+      thread_pool pool(options);
+
+      pool.post([] { throw std::runtime_error("posted"); });
+      pool.schedule_after(std::chrono::milliseconds(1), [] { throw std::runtime_error("timer"); });
+      // Exceptions from submit() stay in the future
+      auto result = pool.submit([] { throw std::runtime_error("submitted"); });
+      CHECK_THROWS_AS(result.get(), std::runtime_error);
+
+      CHECK(eventually([&] {
+        std::lock_guard<std::mutex> guard(mutex);
+        return errors.size() == 2;
+      }));
+      std::lock_guard<std::mutex> guard(mutex);
+      std::sort(errors.begin(), errors.end());
+      CHECK(errors == std::vector<std::string>{"posted", "timer"});
+    }
+
+    SECTION("schedule_after") {
+      thread_pool pool;
+      std::promise<std::chrono::steady_clock::time_point> ran;
+      const auto start = std::chrono::steady_clock::now();
+      auto handle = pool.schedule_after(std::chrono::milliseconds(20), [&ran] {
+        ran.set_value(std::chrono::steady_clock::now());
+      });
+      CHECK(handle.valid());
+      CHECK(ran.get_future().get() - start >= std::chrono::milliseconds(20));
+    }
+
+    SECTION("cancel scheduled task") {
+      thread_pool pool;
+      std::atomic<bool> ran(false);
+      auto handle = pool.schedule_after(std::chrono::milliseconds(20), [&ran] { ran = true; });
+      handle.cancel();
+      CHECK(handle.cancelled());
+
+      std::promise<void> later;
+      pool.schedule_at(std::chrono::steady_clock::now() + std::chrono::milliseconds(40),
+                       [&later] { later.set_value(); });
+      later.get_future().get();
+      CHECK(!ran);
+    }
+
+    SECTION("schedule_every") {
+      thread_pool pool;
+      std::atomic<int> runs(0);
+      auto handle = pool.schedule_every(std::chrono::milliseconds(2), [&runs] { ++runs; });
+      CHECK(eventually([&] { return runs >= 3; }));
+      handle.cancel();
+
+      // A run may be under way while cancelling
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      const int stopped = runs;
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      CHECK(runs == stopped);
+      CHECK_THROWS_AS(pool.schedule_every(std::chrono::seconds(0), [] {}), std::invalid_argument);
+    }
+
+    SECTION("pending timers do not delay destruction") {
+      const auto start = std::chrono::steady_clock::now();
+      {
+        thread_pool pool;
+        pool.schedule_after(std::chrono::hours(1), [] {});
+      }
+      CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+    }
+
+    SECTION("queue capacity") {
+      thread_pool_options options;
+      options.thread_count = 1;
+      options.queue_capacity = 2;
+
+      std::promise<void> release;
+      std::shared_future<void> released = release.get_future().share();
+      std::atomic<bool> blocking(false);
+      // Occupy the worker and fill the queue
+      const auto fill = [&](thread_pool& pool) {
+        std::vector<future<int>> queued;
+        pool.post([released, &blocking] {
+          blocking = true;
+          released.wait();
+        });
+        REQUIRE(eventually([&] { return blocking.load(); }));
+        queued.push_back(pool.submit([] { return 1; }));
+        queued.push_back(pool.submit([] { return 2; }));
+        return queued;
+      };
+
+      SECTION("reject") {
+        options.overflow = overflow_policy::reject;
+        thread_pool pool(options);
+        auto queued = fill(pool);
+        CHECK_THROWS_AS(pool.submit([] { return 3; }), queue_full);
+        CHECK_THROWS_AS(pool.post([] {}), queue_full);
+        release.set_value();
+        CHECK(queued[0].get() == 1);
+        CHECK(pool.overflow().accepted == 3);
+        CHECK(pool.overflow().rejected == 2);
+      }
+
+      SECTION("caller runs") {
+        options.overflow = overflow_policy::caller_runs;
+        thread_pool pool(options);
+        auto queued = fill(pool);
+        auto ran_on = pool.submit([] { return std::this_thread::get_id(); });
+        REQUIRE(ran_on.is_ready());
+        CHECK(ran_on.get() == std::this_thread::get_id());
+        release.set_value();
+        CHECK(pool.overflow().caller_ran == 1);
+      }
+
+      SECTION("drop oldest") {
+        options.overflow = overflow_policy::drop_oldest;
+        thread_pool pool(options);
+        auto queued = fill(pool);
+        auto newest = pool.submit([] { return 3; });
+        release.set_value();
+        CHECK_THROWS_AS(queued[0].get(), std::future_error);
+        CHECK(queued[1].get() == 2);
+        CHECK(newest.get() == 3);
+        CHECK(pool.overflow().dropped == 1);
+      }
+
+      SECTION("drop oldest spares internal tasks") {
+        // Chunks of parallel_for and nodes of a task_graph have no future
+        // to report being dropped on, so a flood of submissions that keeps
+        // the queue full must leave them alone
+        options.thread_count = 2;
+        options.overflow = overflow_policy::drop_oldest;
+        thread_pool pool(options);
+        std::atomic<bool> flooding(true);
+        std::thread flood([&] {
+          while (flooding) {
+            pool.post([] {});
+          }
+        });
+
+        std::atomic<int> elements(0);
+        parallel_for(pool, 0, 1000, 1, [&](int) { ++elements; });
+        CHECK(elements == 1000);
+
+        task_graph graph;
+        std::atomic<int> nodes(0);
+        const auto source = graph.add([&] { ++nodes; });
+        const auto sink = graph.add([&] { ++nodes; });
+        for (int i = 0; i < 20; ++i) {
+          const auto node = graph.add([&] { ++nodes; });
+          graph.precede(source, node);
+          graph.precede(node, sink);
+        }
+        for (int i = 0; i < 10; ++i) {
+          graph.run(pool).get();
+        }
+        CHECK(nodes == 10 * 22);
+
+        flooding = false;
+        flood.join();
+      }
+
+      SECTION("block") {
+        options.overflow = overflow_policy::block;
+        options.block_timeout = std::chrono::milliseconds(10);
+        thread_pool pool(options);
+        auto queued = fill(pool);
+        CHECK_THROWS_AS(pool.submit([] { return 3; }), queue_full);
+
+        std::thread releaser([&release] {
+          std::this_thread::sleep_for(std::chrono::milliseconds(5));
+          release.set_value();
+        });
+        options.block_timeout = std::chrono::milliseconds(0);
+        // Waits for the worker to catch up, however long that takes
+        CHECK(eventually([&] {
+          try {
+            return pool.submit([] { return 3; }).get() == 3;
+          } catch (const queue_full&) {
+            return false;
+          }
+        }));
+        releaser.join();
+        CHECK(pool.overflow().rejected >= 1);
+      }
+    }
+
+    SECTION("lock-free injection") {
+      thread_pool_options options;
+      options.thread_count = 2;
+      options.injection = injection_policy::lock_free;
+      // Small enough for submissions to spill over
+      options.injection_capacity = 4;
+      thread_pool pool(options);
+
+      std::vector<std::thread> submitters;
+      std::vector<std::vector<future<int>>> results(4);
+      for (auto& result : results) {
+        submitters.emplace_back([&pool, &result] {
+          for (int i = 0; i < 250; ++i) {
+            result.push_back(pool.submit(task_priority::background, [i] { return i; }));
+          }
+        });
+      }
+      for (auto& submitter : submitters) {
+        submitter.join();
+      }
+
+      int sum = 0;
+      for (auto& result : results) {
+        for (auto& value : result) {
+          sum += value.get();
+        }
+      }
+      CHECK(sum == 4 * (249 * 250 / 2));
+    }
+
+    SECTION("lock-free injection keeps order when spilling over") {
+      thread_pool_options options;
+      options.thread_count = 1;
+      options.injection = injection_policy::lock_free;
+      options.injection_capacity = 4;
+      thread_pool pool(options);
+
+      std::promise<void> release;
+      std::shared_future<void> released = release.get_future().share();
+      auto blocker = pool.submit([released] { released.wait(); });
+
+      // Half of these spill over; the first one queues another task while
+      // the spilled ones still wait, which must not overtake them
+      std::mutex mutex;
+      std::vector<int> order;
+      const auto record = [&](int i) {
+        std::lock_guard<std::mutex> guard(mutex);
+        order.push_back(i);
+      };
+      std::vector<future<void>> done;
+      future<void> late;
+      done.push_back(pool.submit(task_priority::high, [&] {
+        record(0);
+        late = pool.submit(task_priority::high, record, 8);
+      }));
+      for (int i = 1; i < 8; ++i) {
+        done.push_back(pool.submit(task_priority::high, record, i));
+      }
+
+      release.set_value();
+      blocker.get();
+      for (auto& f : done) {
+        f.get();
+      }
+      late.get();
+      CHECK(order == std::vector<int>{0, 1, 2, 3, 4, 5, 6, 7, 8});
+    }
+
+    SECTION("exception") {
+      thread_pool pool;
+      auto result = pool.submit([]() -> int { throw std::runtime_error("oops"); });
+      CHECK_THROWS_AS(result.get(), std::runtime_error);
+    }
+  }
+
+  TEST_CASE("work_stealing_queue") {
+    SECTION("owner pops newest, thieves take oldest") {
+      work_stealing_queue<int> queue;
+      for (int i = 0; i < 4; ++i) {
+        queue.push(i);
+      }
+
+      int value = -1;
+      std::thread thief([&queue, &value] { CHECK(queue.try_steal(value)); });
+      thief.join();
+      CHECK(value == 0);
+      REQUIRE(queue.try_pop(value));
+      CHECK(value == 3);
+      REQUIRE(queue.try_steal(value));
+      CHECK(value == 1);
+      REQUIRE(queue.try_pop(value));
+      CHECK(value == 2);
+      CHECK_FALSE(queue.try_pop(value));
+      CHECK_FALSE(queue.try_steal(value));
+    }
+
+    SECTION("tasks pushed by a worker") {
+      thread_pool_options options;
+      options.thread_count = 1;
+      thread_pool pool(options);
+
+      std::mutex mutex;
+      std::vector<std::pair<int, std::thread::id>> ran;
+      const auto record = [&mutex, &ran](int task) {
+        std::lock_guard<std::mutex> guard(mutex);
+        ran.emplace_back(task, std::this_thread::get_id());
+      };
+
+      std::promise<void> pushed;
+      std::promise<void> stolen;
+      std::promise<std::thread::id> owner;
+      auto done = pool.submit([&] {
+        owner.set_value(std::this_thread::get_id());
+        for (int i = 0; i < 3; ++i) {
+          pool.post([&record, i] { record(i); });
+        }
+        pushed.set_value();
+        stolen.get_future().wait();
+        // The owner takes the rest newest first
+        while (pool.run_pending_task()) {
+        }
+      });
+
+      const auto owner_id = owner.get_future().get();
+      pushed.get_future().wait();
+      // Not a worker of the pool, so this steals, oldest first
+      REQUIRE(pool.run_pending_task());
+      stolen.set_value();
+      done.get();
+
+      REQUIRE(ran.size() == 3);
+      CHECK(ran[0] == std::make_pair(0, std::this_thread::get_id()));
+      CHECK(ran[1] == std::make_pair(2, owner_id));
+      CHECK(ran[2] == std::make_pair(1, owner_id));
+    }
+  }
+
+  TEST_CASE("locked_queue") {
+    locked_queue<int> queue;
+    for (int i = 0; i < 5; ++i) {
+      queue.push(i);
+    }
+
+    std::vector<int> values;
+    CHECK(queue.try_pop_bulk(std::back_inserter(values), 3) == 3);
+    CHECK(values == std::vector<int>{0, 1, 2});
+    CHECK(queue.wait_and_pop_bulk(std::back_inserter(values), 3) == 2);
+    CHECK(values == std::vector<int>{0, 1, 2, 3, 4});
+    CHECK(queue.try_pop_bulk(std::back_inserter(values), 3) == 0);
+
+    std::thread producer([&queue] { queue.push(5); });
+    CHECK(queue.wait_and_pop_bulk(std::back_inserter(values), 3) == 1);
+    CHECK(values.back() == 5);
+    producer.join();
+  }
+
+  TEST_CASE("mpmc_queue") {
+    SECTION("capacity") {
+      CHECK(mpmc_queue<int>(0).capacity() == 2);
+      CHECK(mpmc_queue<int>(5).capacity() == 8);
+      CHECK(mpmc_queue<int>(8).capacity() == 8);
+    }
+
+    SECTION("fifo") {
+      mpmc_queue<int> queue(4);
+      for (int i = 0; i < 4; ++i) {
+        int value = i;
+        REQUIRE(queue.try_push(value));
+      }
+      int rejected = 4;
+      CHECK_FALSE(queue.try_push(rejected));
+      CHECK(rejected == 4);
+
+      int value = -1;
+      for (int i = 0; i < 4; ++i) {
+        REQUIRE(queue.try_pop(value));
+        CHECK(value == i);
+      }
+      CHECK_FALSE(queue.try_pop(value));
+    }
+
+    SECTION("producers and consumers") {
+      constexpr int per_producer = 10000;
+      mpmc_queue<int> queue(16);
+      std::atomic<long> sum(0);
+
+      std::vector<std::thread> threads;
+      for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&queue] {
+          for (int value = 1; value <= per_producer; ++value) {
+            queue.push(value);
+          }
+        });
+        threads.emplace_back([&queue, &sum] {
+          for (int count = 0; count < per_producer; ++count) {
+            int value = 0;
+            queue.wait_and_pop(value);
+            sum += value;
+          }
+        });
+      }
+      for (auto& thread : threads) {
+        thread.join();
+      }
+      CHECK(sum == 4L * per_producer * (per_producer + 1) / 2);
+    }
+  }
+
+  TEST_CASE("interruptible_thread") {
+    std::mutex mutex;
+    std::condition_variable_any cond;
+    std::atomic<bool> waiting(false);
+    std::atomic<bool> interrupted(false);
+
+    interruptible_thread thread([&] {
+      std::unique_lock<std::mutex> lock(mutex);
+      waiting = true;
+      try {
+        interruptible_wait(cond, lock, [] { return false; });
+      } catch (const thread_interrupted&) {
+        interrupted = true;
+        throw;
+      }
+    });
+    REQUIRE(eventually([&] { return waiting.load(); }));
+
+    // Nobody notifies cond; the interrupt alone has to wake the thread
+    thread.interrupt();
+    thread.join();
+    CHECK(interrupted);
+
+    SECTION("timeout") {
+      std::unique_lock<std::mutex> lock(mutex);
+      CHECK_FALSE(
+          interruptible_wait_for(cond, lock, std::chrono::milliseconds(5), [] { return false; }));
+      CHECK(interruptible_wait_for(cond, lock, std::chrono::milliseconds(5), [] { return true; }));
+    }
+  }
+
+} // namespace
@@ -0,0 +1,84 @@
+#include <chrono>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <timer_wheel.hpp>
+
+using namespace foo;
+
+namespace {
+  TEST_CASE("timer_wheel") {
+    typedef timer_wheel<int>::clock_type clock_type;
+    const auto origin = clock_type::now();
+    const auto ms = [origin](long count) { return origin + std::chrono::milliseconds(count); };
+    timer_wheel<int> wheel(std::chrono::milliseconds(1), origin);
+    std::vector<int> expired;
+    const auto collect = [&expired](int&& value) { expired.push_back(value); };
+
+    SECTION("empty") {
+      CHECK(wheel.empty());
+      CHECK(!wheel.next_expiry());
+      wheel.advance(ms(1000), collect);
+      CHECK(expired.empty());
+    }
+
+    SECTION("expires in order") {
+      wheel.add(ms(30), 3);
+      wheel.add(ms(10), 1);
+      wheel.add(ms(20), 2);
+      CHECK(wheel.size() == 3);
+      CHECK(wheel.next_expiry() == ms(10));
+
+      wheel.advance(ms(9), collect);
+      CHECK(expired.empty());
+      wheel.advance(ms(25), collect);
+      CHECK(expired == std::vector<int>{1, 2});
+      wheel.advance(ms(30), collect);
+      CHECK(expired == std::vector<int>{1, 2, 3});
+      CHECK(wheel.empty());
+    }
+
+    SECTION("past due expires on next advance") {
+      wheel.advance(ms(100), collect);
+      wheel.add(ms(50), 1);
+      wheel.advance(ms(100), collect);
+      CHECK(expired.empty());
+      wheel.advance(ms(101), collect);
+      CHECK(expired == std::vector<int>{1});
+    }
+
+    SECTION("cascades from higher levels") {
+      // Beyond one revolution of level 0, 1, 2 and the whole wheel
+      const std::vector<long> due = {100, 5000, 300000, 20000000};
+      for (std::size_t i = 0; i < due.size(); ++i) {
+        wheel.add(ms(due[i]), static_cast<int>(i));
+      }
+
+      for (std::size_t i = 0; i < due.size(); ++i) {
+        wheel.advance(ms(due[i] - 1), collect);
+        CHECK(expired.size() == i);
+        wheel.advance(ms(due[i]), collect);
+        CHECK(expired.size() == i + 1);
+      }
+      CHECK(expired == std::vector<int>{0, 1, 2, 3});
+    }
+
+    SECTION("next expiry is never late") {
+      wheel.add(ms(1000), 1);
+      auto next = wheel.next_expiry();
+      while (next && expired.empty()) {
+        REQUIRE(*next <= ms(1000));
+        wheel.advance(*next, collect);
+        next = wheel.next_expiry();
+      }
+      CHECK(expired == std::vector<int>{1});
+    }
+  }
+
+  TEST_CASE("timer_handle") {
+    timer_handle empty;
+    CHECK(!empty.valid());
+    empty.cancel();
+    CHECK(!empty.cancelled());
+  }
+} // namespace
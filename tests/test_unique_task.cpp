@@ -0,0 +1,68 @@
+#include <array>
+#include <memory>
+#include <utility>
+
+#include <catch2/catch.hpp>
+#include <unique_task.hpp>
+
+using namespace foo;
+
+namespace {
+  TEST_CASE("unique_task") {
+
+    SECTION("empty") {
+      unique_task task;
+      CHECK(!task);
+    }
+
+    SECTION("small callable is stored inline") {
+      int value = 0;
+      auto set = [&value] { value = 42; };
+      CHECK(unique_task::stored_inline<decltype(set)>());
+
+      unique_task task(set);
+      REQUIRE(task);
+      task();
+      CHECK(value == 42);
+    }
+
+    SECTION("large callable") {
+      std::array<char, 2 * unique_task::inline_size> large{};
+      int value = 0;
+      auto set = [large, &value] { value = static_cast<int>(large.size()); };
+      CHECK(!unique_task::stored_inline<decltype(set)>());
+
+      unique_task task(set);
+      unique_task moved(std::move(task));
+      CHECK(!task);
+      moved();
+      CHECK(value == 2 * unique_task::inline_size);
+    }
+
+    SECTION("move-only callable") {
+      auto owned = std::make_unique<int>(7);
+      int value = 0;
+      unique_task task([owned = std::move(owned), &value] { value = *owned; });
+
+      unique_task other;
+      other = std::move(task);
+      CHECK(!task);
+      other();
+      CHECK(value == 7);
+    }
+
+    SECTION("destroys callable") {
+      auto shared = std::make_shared<int>(1);
+      {
+        unique_task task([shared] {});
+        CHECK(shared.use_count() == 2);
+        task.reset();
+        CHECK(shared.use_count() == 1);
+        task = unique_task([shared] {});
+        CHECK(shared.use_count() == 2);
+      }
+      CHECK(shared.use_count() == 1);
+    }
+  }
+
+} // namespace
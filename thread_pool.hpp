@@ -1,37 +1,76 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <exception>
+#include <fstream>
 #include <functional>
 #include <future>
-#include <iostream>
+#include <iterator>
 #include <memory>
 #include <mutex>
-#include <ostream>
 #include <queue>
 #include <stack>
 #include <stdexcept>
 #include <string>
+#include <system_error>
 #include <thread>
 #include <tuple>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
+#include "future.hpp"
+#include "timer_wheel.hpp"
+#include "unique_task.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#  include <pthread.h>
+#endif
+#if defined(__linux__)
+#  include <sched.h>
+#endif
+#if defined(_MSC_VER)
+#  include <intrin.h>
+#endif
+
 namespace foo {
   // Exception indicating that the current thread has been interrupted
   class thread_interrupted final : public std::exception {};
 
+  // Thrown by submit() and post() when thread_pool's queues are full, see
+  // overflow_policy
+  class queue_full final : public std::exception {
+  public:
+    const char* what() const noexcept override { return "queue full"; }
+  };
+
+  // Exception stored in the future of a task whose deadline passed before
+  // it got to run
+  class deadline_exceeded final : public std::exception {
+  public:
+    const char* what() const noexcept override { return "deadline exceeded"; }
+  };
+
   namespace internal {
+    // Interrupt flag of a thread; waits registered with wait() or
+    // wait_until() are woken by set() (C++ Concurrency in Action, listing
+    // 9.12). The waiting thread holds set_clear_mutex_ from registering
+    // until the condition variable has released it, so set() cannot slip in
+    // between its check of the flag and its going to sleep.
     class interrupt_flag {
     public:
-      interrupt_flag() : flag_(false), thread_cond_(nullptr), mutex_() {}
+      interrupt_flag() : flag_(false), thread_cond_(nullptr), set_clear_mutex_() {}
 
       void set() {
         flag_.store(true, std::memory_order_relaxed);
-        std::lock_guard<std::mutex> guard(mutex_);
+        std::lock_guard<std::mutex> guard(set_clear_mutex_);
         if (thread_cond_) {
           thread_cond_->notify_all();
         }
@@ -39,39 +78,230 @@ namespace foo {
 
       bool is_set() const { return flag_.load(std::memory_order_relaxed); }
 
-      void set_condition_variable(std::condition_variable& cond) {
-        std::lock_guard<std::mutex> guard(mutex_);
-        thread_cond_ = std::addressof(cond);
+      // Wait on cond until notified or set(); throws thread_interrupted if
+      // the flag is set
+      template <typename Lockable> void wait(std::condition_variable_any& cond, Lockable& lock) {
+        custom_lock<Lockable> registered(this, cond, lock);
+        check();
+        cond.wait(registered);
+        check();
       }
 
-      void clear_condition_variable() {
-        std::lock_guard<std::mutex> guard(mutex_);
-        thread_cond_ = nullptr;
+      // Like wait(), but gives up at deadline
+      template <typename Lockable, typename Clock, typename Duration>
+      std::cv_status wait_until(std::condition_variable_any& cond, Lockable& lock,
+                                const std::chrono::time_point<Clock, Duration>& deadline) {
+        custom_lock<Lockable> registered(this, cond, lock);
+        check();
+        const std::cv_status status = cond.wait_until(registered, deadline);
+        check();
+        return status;
       }
 
     private:
+      // Locks set_clear_mutex_ along with the caller's lock, and registers
+      // cond for set() to notify while it exists
+      template <typename Lockable> class custom_lock final {
+      public:
+        custom_lock(interrupt_flag* self, std::condition_variable_any& cond, Lockable& lock)
+            : self_(self), lock_(lock) {
+          self_->set_clear_mutex_.lock();
+          self_->thread_cond_ = std::addressof(cond);
+        }
+
+        ~custom_lock() {
+          self_->thread_cond_ = nullptr;
+          self_->set_clear_mutex_.unlock();
+        }
+
+        void unlock() {
+          lock_.unlock();
+          self_->set_clear_mutex_.unlock();
+        }
+
+        void lock() { std::lock(self_->set_clear_mutex_, lock_); }
+
+        custom_lock(const custom_lock&) = delete;
+        custom_lock& operator=(const custom_lock&) = delete;
+
+      private:
+        interrupt_flag* self_;
+        Lockable& lock_;
+      };
+
+      void check() const {
+        if (is_set()) {
+          throw thread_interrupted();
+        }
+      }
+
       std::atomic<bool> flag_;
-      std::condition_variable* thread_cond_;
-      std::mutex mutex_;
+      std::condition_variable_any* thread_cond_;
+      std::mutex set_clear_mutex_;
     };
 
-    thread_local interrupt_flag this_thread_interrupt_flag;
+    inline thread_local interrupt_flag this_thread_interrupt_flag;
+  } // namespace internal
+
+  // Attributes to create an interruptible_thread with
+  struct thread_attributes final {
+    // Stack size in bytes; 0 keeps the platform default. Only honored with
+    // pthreads.
+    std::size_t stack_size = 0;
+  };
+
+  namespace internal {
+    // Like std::thread, but can be given thread_attributes, which std::thread
+    // has no way to pass. With a stack size, it creates a pthread with
+    // attributes of its own, leaving the process-wide defaults alone.
+    class native_thread final {
+    public:
+      native_thread() noexcept : thread_() {}
+
+      template <typename Function>
+      native_thread(const thread_attributes& attributes, Function function) : native_thread() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (attributes.stack_size > 0) {
+          start(attributes.stack_size, std::move(function));
+          return;
+        }
+#else
+        (void)attributes;
+#endif
+        thread_ = std::thread(std::move(function));
+      }
+
+      ~native_thread() {
+        if (joinable()) {
+          std::terminate();
+        }
+      }
+
+      native_thread(native_thread&& other) noexcept : native_thread() { swap(other); }
+
+      native_thread& operator=(native_thread&& rhs) noexcept {
+        if (joinable()) {
+          std::terminate();
+        }
+        swap(rhs);
+        return *this;
+      }
+
+      void swap(native_thread& other) noexcept {
+        using std::swap;
+        swap(thread_, other.thread_);
+#if defined(__unix__) || defined(__APPLE__)
+        swap(handle_, other.handle_);
+        swap(native_, other.native_);
+#endif
+      }
+
+      bool joinable() const noexcept {
+#if defined(__unix__) || defined(__APPLE__)
+        if (native_) {
+          return true;
+        }
+#endif
+        return thread_.joinable();
+      }
+
+      void join() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (native_) {
+          if (const int error = pthread_join(handle_, nullptr)) {
+            throw std::system_error(error, std::generic_category(), "pthread_join");
+          }
+          native_ = false;
+          return;
+        }
+#endif
+        thread_.join();
+      }
+
+      void detach() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (native_) {
+          if (const int error = pthread_detach(handle_)) {
+            throw std::system_error(error, std::generic_category(), "pthread_detach");
+          }
+          native_ = false;
+          return;
+        }
+#endif
+        thread_.detach();
+      }
+
+      std::thread::native_handle_type native_handle() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (native_) {
+          return handle_;
+        }
+#endif
+        return thread_.native_handle();
+      }
+
+      native_thread(const native_thread&) = delete;
+      native_thread& operator=(const native_thread&) = delete;
+
+    private:
+#if defined(__unix__) || defined(__APPLE__)
+      template <typename Function> void start(std::size_t stack_size, Function function) {
+        pthread_attr_t attr;
+        if (const int error = pthread_attr_init(&attr)) {
+          throw std::system_error(error, std::generic_category(), "pthread_attr_init");
+        }
+        // Best effort, like the platform default: a size the platform does
+        // not take leaves the default in place
+        pthread_attr_setstacksize(&attr, stack_size);
+
+        auto arg = std::make_unique<Function>(std::move(function));
+        const int error = pthread_create(&handle_, &attr, &run<Function>, arg.get());
+        pthread_attr_destroy(&attr);
+        if (error) {
+          throw std::system_error(error, std::generic_category(), "pthread_create");
+        }
+        arg.release();
+        native_ = true;
+      }
 
-    struct clear_condition_variable_on_destruct {
-      ~clear_condition_variable_on_destruct() {
-        this_thread_interrupt_flag.clear_condition_variable();
+      template <typename Function> static void* run(void* arg) {
+        std::unique_ptr<Function> function(static_cast<Function*>(arg));
+        try {
+          (*function)();
+        } catch (...) {
+          // What std::thread does, too
+          std::terminate();
+        }
+        return nullptr;
       }
+#endif
+
+      std::thread thread_;
+#if defined(__unix__) || defined(__APPLE__)
+      pthread_t handle_{};
+      // Whether handle_ refers to a thread not joined or detached yet
+      bool native_ = false;
+#endif
     };
   } // namespace internal
 
   class interruptible_thread {
   public:
     // Construct with no thread
-    interruptible_thread() : internal_thread_(), flag_(nullptr) {}
+    interruptible_thread() : internal_thread_(), flag_(nullptr), id_() {}
 
     // Construct with func(args...)
+    template <typename Function, typename... Args,
+              typename = std::enable_if_t<
+                  !std::is_same<std::decay_t<Function>, thread_attributes>::value>>
+    explicit interruptible_thread(Function&& func, Args&&... args)
+        : interruptible_thread(thread_attributes(), std::forward<Function>(func),
+                               std::forward<Args>(args)...) {}
+
+    // Construct with func(args...) on a thread with the given attributes
     template <typename Function, typename... Args>
-    explicit interruptible_thread(Function&& func, Args&&... args) : interruptible_thread() {
+    interruptible_thread(const thread_attributes& attributes, Function&& func, Args&&... args)
+        : interruptible_thread() {
       struct wrapper final {
         Function wrapped_function;
         std::tuple<Args...> arguments;
@@ -79,13 +309,17 @@ namespace foo {
         explicit wrapper(Function&& f, Args&&... as)
             : wrapped_function(std::forward<Function>(f)), arguments(std::forward<Args>(as)...) {}
 
-        void operator()(internal::interrupt_flag** flag_ptr, std::mutex* m,
+        void operator()(internal::interrupt_flag** flag_ptr, std::thread::id* id_ptr, std::mutex* m,
                         std::condition_variable* c) {
           {
+            // Notify while holding the lock: c lives on the stack of the
+            // constructing thread, which may return as soon as it sees the
+            // flag pointer
             std::lock_guard<std::mutex> guard(*m);
+            *id_ptr = std::this_thread::get_id();
             *flag_ptr = std::addressof(internal::this_thread_interrupt_flag);
+            c->notify_one();
           }
-          c->notify_one();
           try {
             std::apply(wrapped_function, arguments);
           } catch (thread_interrupted&) {
@@ -96,9 +330,12 @@ namespace foo {
 
       std::mutex flag_mutex;
       std::condition_variable flag_condition;
-      internal_thread_ =
-          std::thread(wrapper(std::forward<Function>(func), std::forward<Args>(args)...), &flag_,
-                      &flag_mutex, &flag_condition);
+      internal_thread_ = internal::native_thread(
+          attributes,
+          [w = wrapper(std::forward<Function>(func), std::forward<Args>(args)...),
+           flag_ptr = &flag_, id_ptr = &id_, m = &flag_mutex, c = &flag_condition]() mutable {
+            w(flag_ptr, id_ptr, m, c);
+          });
       std::unique_lock<std::mutex> lock(flag_mutex);
       while (!flag_) {
         flag_condition.wait(lock);
@@ -112,20 +349,20 @@ namespace foo {
     void swap(interruptible_thread& other) noexcept {
       using std::swap;
       swap(flag_, other.flag_);
-      swap(internal_thread_, other.internal_thread_);
+      swap(id_, other.id_);
+      internal_thread_.swap(other.internal_thread_);
     }
 
     // Move-construct from other
     interruptible_thread(interruptible_thread&& other) noexcept
-        : internal_thread_(std::move(other.internal_thread_)), flag_(other.flag_) {
+        : internal_thread_(std::move(other.internal_thread_)), flag_(other.flag_), id_(other.id_) {
       other.flag_ = nullptr;
+      other.id_ = std::thread::id();
     }
 
     // Move-assign from rhs
     interruptible_thread& operator=(interruptible_thread&& rhs) noexcept {
-      using std::swap;
-      swap(flag_, rhs.flag_);
-      swap(internal_thread_, rhs.internal_thread_);
+      swap(rhs);
       return *this;
     }
 
@@ -133,12 +370,18 @@ namespace foo {
     bool joinable() const noexcept { return internal_thread_.joinable(); }
 
     // Terminate thread
-    void join() { internal_thread_.join(); }
+    void join() {
+      internal_thread_.join();
+      id_ = std::thread::id();
+    }
 
     // Detach thread
-    void detach() { internal_thread_.detach(); }
+    void detach() {
+      internal_thread_.detach();
+      id_ = std::thread::id();
+    }
 
-    std::thread::id get_id() const noexcept { return internal_thread_.get_id(); }
+    std::thread::id get_id() const noexcept { return id_; }
 
     // On Windows: Win32 HANDLE as void *; on Linux: some representation
     // of pthread_t
@@ -152,8 +395,9 @@ namespace foo {
     }
 
   private:
-    std::thread internal_thread_;
+    internal::native_thread internal_thread_;
     internal::interrupt_flag* flag_;
+    std::thread::id id_;
   };
 
   static_assert(std::is_default_constructible<interruptible_thread>::value);
@@ -179,33 +423,43 @@ namespace foo {
   //        }
   //    }
   //
-  void interruption_point() {
+  inline void interruption_point() {
     if (internal::this_thread_interrupt_flag.is_set()) {
       throw thread_interrupted();
     }
   }
 
-  // Lets you wait on a condition variable in an interruptible way
-  template <typename Predicate>
-  inline void interruptible_wait(std::condition_variable& cond, std::unique_lock<std::mutex>& lock,
+  // Lets you wait on a condition variable in an interruptible way; an
+  // interrupt wakes the thread right away
+  template <typename Lockable, typename Predicate>
+  inline void interruptible_wait(std::condition_variable_any& cond, Lockable& lock,
                                  Predicate pred) {
     interruption_point();
-    internal::this_thread_interrupt_flag.set_condition_variable(cond);
-    internal::clear_condition_variable_on_destruct guard;
-    while (!internal::this_thread_interrupt_flag.is_set() && !pred()) {
-      cond.wait_for(lock, std::chrono::milliseconds(1));
+    while (!pred()) {
+      internal::this_thread_interrupt_flag.wait(cond, lock);
     }
-    interruption_point();
   }
 
-  inline void interruptible_wait(std::condition_variable& cond,
-                                 std::unique_lock<std::mutex>& lock) {
-    interruption_point();
-    internal::this_thread_interrupt_flag.set_condition_variable(cond);
-    internal::clear_condition_variable_on_destruct guard;
-    interruption_point();
-    cond.wait_for(lock, std::chrono::milliseconds(1));
+  // Like interruptible_wait, but gives up once timeout has passed; returns
+  // the final value of pred()
+  template <typename Lockable, typename Rep, typename Period, typename Predicate>
+  inline bool interruptible_wait_for(std::condition_variable_any& cond, Lockable& lock,
+                                     const std::chrono::duration<Rep, Period>& timeout,
+                                     Predicate pred) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
     interruption_point();
+    while (!pred()) {
+      if (internal::this_thread_interrupt_flag.wait_until(cond, lock, deadline) ==
+          std::cv_status::timeout) {
+        return pred();
+      }
+    }
+    return true;
+  }
+
+  template <typename Lockable>
+  inline void interruptible_wait(std::condition_variable_any& cond, Lockable& lock) {
+    internal::this_thread_interrupt_flag.wait(cond, lock);
   }
 
   // A thread-safe queue using locks and condition variables (from C++
@@ -214,12 +468,38 @@ namespace foo {
   public:
     typedef T value_type;
 
-    locked_queue() = default;
+    locked_queue() : mutex_(), data_(), cond_(), waiters_(0) {}
 
+    // Only notifies if a thread waits, and only after unlocking, so the
+    // woken thread does not block on mutex_ right away. A waiter counted
+    // under the lock is about to wait or waiting already, and either way
+    // gets the notification.
     void push(value_type val) {
-      std::lock_guard<std::mutex> guard(mutex_);
-      data_.push(val);
-      cond_.notify_one();
+      std::unique_lock<std::mutex> lock(mutex_);
+      data_.push(std::move(val));
+      const bool waiting = waiters_ > 0;
+      lock.unlock();
+      if (waiting) {
+        cond_.notify_one();
+      }
+    }
+
+    // Move all values in [first, last) into the queue under one lock
+    template <typename InputIt> void push_bulk(InputIt first, InputIt last) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      std::size_t pushed = 0;
+      for (; first != last; ++first, ++pushed) {
+        data_.push(std::move(*first));
+      }
+      const std::size_t waiting = waiters_;
+      lock.unlock();
+      if (waiting > 0 && pushed >= waiting) {
+        cond_.notify_all();
+      } else {
+        for (std::size_t i = 0; i < std::min(pushed, waiting); ++i) {
+          cond_.notify_one();
+        }
+      }
     }
 
     // Try to get a value from the queue; returns immediately, indicating
@@ -229,7 +509,18 @@ namespace foo {
       if (data_.empty()) {
         return false;
       }
-      val = data_.front();
+      val = std::move(data_.front());
+      data_.pop();
+      return true;
+    }
+
+    // Like try_pop, but only takes the front value if pred(front) is true
+    template <typename Predicate> bool try_pop_if(value_type& val, Predicate pred) {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (data_.empty() || !pred(static_cast<const value_type&>(data_.front()))) {
+        return false;
+      }
+      val = std::move(data_.front());
       data_.pop();
       return true;
     }
@@ -239,18 +530,66 @@ namespace foo {
     // Blocks until there is a value or the current thread was interrupted
     void wait_and_pop(value_type& val) {
       std::unique_lock<std::mutex> lock(mutex_);
-      interruptible_wait(cond_, lock, [this] { return !data_.empty(); });
-      val = data_.front();
+      wait_for_data(lock);
+      val = std::move(data_.front());
       data_.pop();
     }
 
+    // Move up to max values, front first, to out under one lock; returns how
+    // many there were
+    template <typename OutputIt> std::size_t try_pop_bulk(OutputIt out, std::size_t max) {
+      std::lock_guard<std::mutex> guard(mutex_);
+      return pop_bulk(out, max);
+    }
+
+    // Like try_pop_bulk, but blocks until there is at least one value or the
+    // current thread was interrupted
+    template <typename OutputIt> std::size_t wait_and_pop_bulk(OutputIt out, std::size_t max) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wait_for_data(lock);
+      return pop_bulk(out, max);
+    }
+
     locked_queue(const locked_queue&) = delete;
     locked_queue& operator=(const locked_queue&) = delete;
 
   private:
+    // Counts the calling thread in waiters_ while it exists; guarded by
+    // mutex_ like waiters_ itself
+    class waiter_guard final {
+    public:
+      explicit waiter_guard(std::size_t& waiters) : waiters_(waiters) { ++waiters_; }
+      ~waiter_guard() { --waiters_; }
+
+      waiter_guard(const waiter_guard&) = delete;
+      waiter_guard& operator=(const waiter_guard&) = delete;
+
+    private:
+      std::size_t& waiters_;
+    };
+
+    void wait_for_data(std::unique_lock<std::mutex>& lock) {
+      if (data_.empty()) {
+        waiter_guard guard(waiters_);
+        interruptible_wait(cond_, lock, [this] { return !data_.empty(); });
+      }
+    }
+
+    template <typename OutputIt> std::size_t pop_bulk(OutputIt out, std::size_t max) {
+      std::size_t count = 0;
+      for (; count < max && !data_.empty(); ++count) {
+        *out = std::move(data_.front());
+        ++out;
+        data_.pop();
+      }
+      return count;
+    }
+
     mutable std::mutex mutex_;
     std::queue<value_type> data_;
-    std::condition_variable cond_;
+    std::condition_variable_any cond_;
+    // Threads blocked in wait_and_pop or wait_and_pop_bulk
+    std::size_t waiters_;
   };
 
   static_assert(std::is_default_constructible<locked_queue<int>>::value);
@@ -259,94 +598,2315 @@ namespace foo {
   static_assert(!std::is_move_constructible<locked_queue<int>>::value);
   static_assert(!std::is_move_assignable<locked_queue<int>>::value);
 
-  // A very simple thread pool. Slightly adapted from C++ Concurrency in
-  // Action, chapter 9.
-  class thread_pool final {
-  public:
-    typedef interruptible_thread thread_type;
+  namespace internal {
+    // Keeps apart data that different threads write to. Not
+    // std::hardware_destructive_interference_size, whose value may change
+    // with compiler flags, and which GCC warns about in headers for that
+    // reason.
+    inline constexpr std::size_t cache_line_size = 64;
+  } // namespace internal
 
-    thread_pool() : done_(false), tasks_(), workers_(), joiner_(workers_) {
-      // const unsigned int
-      // hwthreads = std::thread::hardware_concurrency();
-      const unsigned int threads = 8U;
-      std::cout << "threads: " << threads << std::endl;
+  // A bounded lock-free queue for any number of producers and consumers
+  // (Dmitry Vyukov's ring buffer): each slot carries a sequence number that
+  // tells producers and consumers whose turn it is, so both sides only
+  // contend on a compare-and-swap of their own position. Has the surface of
+  // locked_queue; push() and wait_and_pop() block only while the queue is
+  // full or empty, respectively.
+  template <typename T> class mpmc_queue final {
+  public:
+    typedef T value_type;
 
-      try {
-        for (unsigned int i = 0; i < threads; ++i) {
-          workers_.emplace_back([this] {
-            while (!done_) {
-              std::function<void()> task;
-              tasks_.wait_and_pop(task);
-              task();
-            }
-          });
-        }
-      } catch (std::exception&) {
-        done_ = true;
-        throw;
+    // Capacity is rounded up to a power of two, at least 2
+    explicit mpmc_queue(std::size_t capacity = 1024)
+        : mask_(round_up(capacity) - 1), slots_(new slot[mask_ + 1]), mutex_(), not_empty_(),
+          not_full_(), poppers_(0), pushers_(0), enqueue_pos_(0), dequeue_pos_(0) {
+      for (std::size_t i = 0; i <= mask_; ++i) {
+        slots_[i].sequence.store(i, std::memory_order_relaxed);
       }
     }
 
-    // Join all worker threads and clean-up
-    ~thread_pool() {
-      done_ = true;
+    // Wait for room if the queue is full
+    //
+    // Blocks until there is room or the current thread was interrupted
+    void push(value_type val) {
+      if (try_push(val)) {
+        return;
+      }
+      waiter_guard guard(pushers_);
+      while (!try_push(val)) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        interruptible_wait(not_full_, lock, [this] { return ready(enqueue_pos_, 0); });
+      }
+    }
 
-      for (auto& thread : workers_) {
-        thread.interrupt();
+    // Move all values in [first, last) into the queue
+    template <typename InputIt> void push_bulk(InputIt first, InputIt last) {
+      for (; first != last; ++first) {
+        push(std::move(*first));
       }
+    }
 
-      // joiner_ will take care of joining
+    // Try to put val into the queue; returns false, leaving val alone, if it
+    // is full
+    bool try_push(value_type& val) {
+      std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+      slot* s;
+      for (;;) {
+        s = &slots_[pos & mask_];
+        const std::size_t sequence = s->sequence.load();
+        const auto diff = static_cast<std::ptrdiff_t>(sequence - pos);
+        if (diff == 0) {
+          if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            break;
+          }
+        } else if (diff < 0) {
+          return false;
+        } else {
+          pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+      }
+      s->value = std::move(val);
+      s->sequence.store(pos + 1);
+      wake(poppers_, not_empty_);
+      return true;
     }
 
-    template <typename Function, typename... Args>
-    auto submit(Function&& function, Args&&... args) // URef
-        -> std::future<typename std::result_of<Function(Args...)>::type> {
-      typedef typename std::result_of<Function(Args...)>::type result_type;
+    // Try to get a value from the queue; returns immediately, indicating
+    // whether there was a value retrieved or not
+    bool try_pop(value_type& val) {
+      std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+      slot* s;
+      for (;;) {
+        s = &slots_[pos & mask_];
+        const std::size_t sequence = s->sequence.load();
+        const auto diff = static_cast<std::ptrdiff_t>(sequence - (pos + 1));
+        if (diff == 0) {
+          if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            break;
+          }
+        } else if (diff < 0) {
+          return false;
+        } else {
+          pos = dequeue_pos_.load(std::memory_order_relaxed);
+        }
+      }
+      val = std::move(s->value);
+      s->sequence.store(pos + mask_ + 1);
+      wake(pushers_, not_full_);
+      return true;
+    }
 
-      if (done_) {
-        throw std::runtime_error("submit on stopped thread_pool");
+    // Wait until there is a value to get from this queue
+    //
+    // Blocks until there is a value or the current thread was interrupted
+    void wait_and_pop(value_type& val) {
+      if (try_pop(val)) {
+        return;
       }
+      waiter_guard guard(poppers_);
+      while (!try_pop(val)) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        interruptible_wait(not_empty_, lock, [this] { return ready(dequeue_pos_, 1); });
+      }
+    }
 
-      auto taskptr = std::make_shared<std::packaged_task<result_type()>>(
-          std::bind(std::forward<Function>(function), std::forward<Args>(args)...));
+    // Move up to max values to out; returns how many there were. Each value
+    // is claimed on its own, so this is only for parity with locked_queue.
+    template <typename OutputIt> std::size_t try_pop_bulk(OutputIt out, std::size_t max) {
+      std::size_t count = 0;
+      value_type val;
+      for (; count < max && try_pop(val); ++count) {
+        *out = std::move(val);
+        ++out;
+      }
+      return count;
+    }
 
-      std::future<result_type> result = taskptr->get_future();
-      tasks_.push([taskptr]() { (*taskptr)(); });
-      return result;
+    // Like try_pop_bulk, but blocks until there is at least one value or the
+    // current thread was interrupted
+    template <typename OutputIt> std::size_t wait_and_pop_bulk(OutputIt out, std::size_t max) {
+      if (max == 0) {
+        return 0;
+      }
+      value_type val;
+      wait_and_pop(val);
+      *out = std::move(val);
+      ++out;
+      return 1 + try_pop_bulk(out, max - 1);
     }
 
-    thread_pool(const thread_pool&) = delete;
-    thread_pool& operator=(const thread_pool&) = delete;
+    std::size_t capacity() const noexcept { return mask_ + 1; }
+
+    mpmc_queue(const mpmc_queue&) = delete;
+    mpmc_queue& operator=(const mpmc_queue&) = delete;
 
   private:
-    // Ensures we join our worker threads at scope exit.
-    class join_threads {
-    public:
-      explicit join_threads(std::vector<thread_type>& threads) : threads_(threads) {}
+    struct slot {
+      std::atomic<std::size_t> sequence;
+      value_type value;
+    };
 
-      ~join_threads() {
-        for (auto& t : threads_) {
-          if (t.joinable()) {
-            t.join();
-          }
-        }
+    // Registers a thread about to block for the duration of its wait
+    class waiter_guard final {
+    public:
+      explicit waiter_guard(std::atomic<std::size_t>& waiters) : waiters_(waiters) {
+        waiters_.fetch_add(1);
       }
+      ~waiter_guard() { waiters_.fetch_sub(1); }
+
+      waiter_guard(const waiter_guard&) = delete;
+      waiter_guard& operator=(const waiter_guard&) = delete;
 
     private:
-      std::vector<thread_type>& threads_;
+      std::atomic<std::size_t>& waiters_;
     };
 
-    std::atomic<bool> done_;
-    locked_queue<std::function<void()>> tasks_;
-    std::vector<thread_type> workers_;
-    join_threads joiner_;
+    // Returns whether the slot at position could be claimed now; offset is 0
+    // for producers and 1 for consumers. Does not claim it, as the caller
+    // holds mutex_, which a successful claim takes to wake others.
+    bool ready(const std::atomic<std::size_t>& position, std::size_t offset) const {
+      const std::size_t pos = position.load();
+      return slots_[pos & mask_].sequence.load() == pos + offset;
+    }
+
+    static std::size_t round_up(std::size_t capacity) {
+      std::size_t size = 2;
+      while (size < capacity) {
+        size *= 2;
+      }
+      return size;
+    }
+
+    // Wake threads blocked in the slow path; free unless there are any.
+    // Sequence numbers and waiter counts are all sequentially consistent, so
+    // either a waiter's next attempt sees the slot just changed, or this sees
+    // the waiter.
+    void wake(std::atomic<std::size_t>& waiters, std::condition_variable_any& cond) {
+      if (waiters.load() > 0) {
+        // Taking the mutex orders this after a waiter's failed attempt
+        std::lock_guard<std::mutex> guard(mutex_);
+        cond.notify_all();
+      }
+    }
+
+    const std::size_t mask_;
+    const std::unique_ptr<slot[]> slots_;
+    // Only for the slow path
+    std::mutex mutex_;
+    std::condition_variable_any not_empty_;
+    std::condition_variable_any not_full_;
+    std::atomic<std::size_t> poppers_;
+    std::atomic<std::size_t> pushers_;
+    // Written by producers and consumers, respectively; each on a cache line
+    // of its own, as the alignment pads the class to a whole line as well
+    alignas(internal::cache_line_size) std::atomic<std::size_t> enqueue_pos_;
+    alignas(internal::cache_line_size) std::atomic<std::size_t> dequeue_pos_;
   };
 
-  static_assert(std::is_default_constructible<thread_pool>::value);
-  static_assert(!std::is_copy_constructible<thread_pool>::value);
-  static_assert(!std::is_copy_assignable<thread_pool>::value);
-  static_assert(!std::is_move_constructible<thread_pool>::value);
-  static_assert(!std::is_move_assignable<thread_pool>::value);
+  static_assert(std::is_constructible<mpmc_queue<int>, std::size_t>::value);
+  static_assert(!std::is_copy_constructible<mpmc_queue<int>>::value);
+  static_assert(!std::is_copy_assignable<mpmc_queue<int>>::value);
+  static_assert(!std::is_move_constructible<mpmc_queue<int>>::value);
+  static_assert(!std::is_move_assignable<mpmc_queue<int>>::value);
+
+  // A deque of tasks owned by one worker thread: the owner pushes and pops at
+  // the front (LIFO, for cache locality) while other threads steal from the
+  // back (FIFO, taking the oldest and usually largest pieces of work). Adapted
+  // from C++ Concurrency in Action, chapter 9.1.5.
+  template <typename T> class work_stealing_queue final {
+  public:
+    typedef T value_type;
+
+    work_stealing_queue() = default;
+
+    void push(value_type val) {
+      std::lock_guard<std::mutex> guard(mutex_);
+      data_.push_front(std::move(val));
+    }
+
+    // Move all values in [first, last) into the queue under one lock
+    template <typename InputIt> void push_bulk(InputIt first, InputIt last) {
+      std::lock_guard<std::mutex> guard(mutex_);
+      for (; first != last; ++first) {
+        data_.push_front(std::move(*first));
+      }
+    }
+
+    bool empty() const {
+      std::lock_guard<std::mutex> guard(mutex_);
+      return data_.empty();
+    }
+
+    // Pop the most recently pushed value; meant to be called by the owner
+    bool try_pop(value_type& val) {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (data_.empty()) {
+        return false;
+      }
+      val = std::move(data_.front());
+      data_.pop_front();
+      return true;
+    }
+
+    // Take the least recently pushed value; meant to be called by thieves
+    bool try_steal(value_type& val) {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (data_.empty()) {
+        return false;
+      }
+      val = std::move(data_.back());
+      data_.pop_back();
+      return true;
+    }
+
+    // Like try_steal, but only takes the back value if pred(back) is true
+    template <typename Predicate> bool try_steal_if(value_type& val, Predicate pred) {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (data_.empty() || !pred(static_cast<const value_type&>(data_.back()))) {
+        return false;
+      }
+      val = std::move(data_.back());
+      data_.pop_back();
+      return true;
+    }
+
+    work_stealing_queue(const work_stealing_queue&) = delete;
+    work_stealing_queue& operator=(const work_stealing_queue&) = delete;
+
+  private:
+    mutable std::mutex mutex_;
+    std::deque<value_type> data_;
+  };
+
+  static_assert(std::is_default_constructible<work_stealing_queue<int>>::value);
+  static_assert(!std::is_copy_constructible<work_stealing_queue<int>>::value);
+  static_assert(!std::is_copy_assignable<work_stealing_queue<int>>::value);
+
+  // Order in which a worker runs the tasks in its own queue
+  enum class queue_policy {
+    lifo, // newest first; best cache locality for recursive work
+    fifo  // oldest first; fairer when tasks are independent
+  };
+
+  // How thread_pool pins its workers to CPUs
+  enum class affinity_policy {
+    none,    // leave placement to the OS
+    compact, // fill one core after the other, SMT siblings included
+    scatter, // spread over packages and cores first, SMT siblings last
+    skip_smt // one worker per physical core, wrapping around if there are more
+  };
+
+  // Kind of queue thread_pool takes submissions from outside its workers in
+  enum class injection_policy {
+    locked,   // locked_queue; cheapest with few submitting threads
+    lock_free // mpmc_queue, spilling over into a locked_queue when full
+  };
+
+  // What thread_pool does with a submission that finds the queues full
+  enum class overflow_policy {
+    block,       // wait for room, up to block_timeout, then throw queue_full
+    caller_runs, // run the task on the submitting thread
+    reject,      // throw queue_full
+    drop_oldest  // drop the oldest queued submission; its future is broken_promise
+  };
+
+  // Construction parameters for thread_pool
+  struct thread_pool_options final {
+    // Number of worker threads; 0 picks default_thread_count()
+    unsigned int thread_count = 0;
+
+    // Upper bound for the pool to grow to under load; 0 or anything below
+    // thread_count keeps the pool at a fixed size
+    unsigned int max_thread_count = 0;
+
+    // Extra workers (beyond thread_count) retire after being idle this long
+    std::chrono::milliseconds keep_alive = std::chrono::seconds(60);
+
+    // A submit spawns an extra worker if no worker is idle and either this
+    // many tasks are queued, or no worker has picked up a task for
+    // grow_queue_wait
+    std::size_t grow_queue_depth = 32;
+    std::chrono::milliseconds grow_queue_wait = std::chrono::milliseconds(20);
+
+    queue_policy policy = queue_policy::lifo;
+
+    // Queues for submissions from threads other than the workers, and the
+    // number of slots of each if they are lock_free
+    injection_policy injection = injection_policy::locked;
+    std::size_t injection_capacity = 1024;
+
+    // Worker i is pinned to the i-th CPU in the order this policy puts the
+    // CPUs the process may run on; Linux only
+    affinity_policy affinity = affinity_policy::none;
+
+    // Split the workers into one group per NUMA node, each with its own
+    // injection queue; see thread_pool. Linux only.
+    bool numa_aware = false;
+
+    // Stack size of the worker threads in bytes; 0 keeps the platform
+    // default. Only honored with pthreads.
+    std::size_t stack_size = 0;
+
+    // Workers are named <prefix><index> if non-empty; Linux truncates thread
+    // names to 15 characters
+    std::string thread_name_prefix;
+
+    // A queued task moves up one priority level for every priority_aging it
+    // waits, so background work cannot starve; zero turns aging off
+    std::chrono::milliseconds priority_aging = std::chrono::milliseconds(100);
+
+    // Granularity of schedule_after, schedule_at and schedule_every
+    std::chrono::milliseconds timer_resolution = std::chrono::milliseconds(1);
+
+    // Most tasks queued at once; 0 is unbounded. Only what is submitted or
+    // posted counts against the limit, and concurrent submitters may
+    // overshoot it by one task each. Continuations, timers and the like
+    // are always queued and never dropped; drop_oldest only drops a
+    // submission that is next up in its queue, and queues the new task
+    // regardless if there is none.
+    std::size_t queue_capacity = 0;
+    overflow_policy overflow = overflow_policy::block;
+    // How long overflow_policy::block waits; zero waits for as long as it
+    // takes. The wait is an interruption point. A worker of the pool never
+    // blocks but runs the task itself.
+    std::chrono::milliseconds block_timeout = std::chrono::milliseconds(0);
+
+    // Called on the worker with whatever a task started by post() or a
+    // timer throws; such exceptions are dropped if empty. Exceptions
+    // thrown by the handler itself are dropped.
+    std::function<void(std::exception_ptr)> exception_handler;
+  };
+
+  // Priority of a task submitted to thread_pool
+  enum class task_priority {
+    high,      // runs before anything else queued
+    normal,    // what submit() without priority uses
+    background // runs when nothing else is waiting, or once it aged enough
+  };
+
+  // What became of the submissions to a thread_pool with a queue_capacity,
+  // in tasks
+  struct overflow_stats final {
+    // Queued right away
+    std::uint64_t accepted = 0;
+    // Queued after waiting for room
+    std::uint64_t blocked = 0;
+    // Run by the submitting thread
+    std::uint64_t caller_ran = 0;
+    // Refused with queue_full
+    std::uint64_t rejected = 0;
+    // Queued tasks dropped to make room
+    std::uint64_t dropped = 0;
+  };
+
+  // Asks thread_pool to run a task on a worker of the given NUMA node, as
+  // numbered by thread_pool (0 to node_count() - 1)
+  struct node_hint final {
+    unsigned int node;
+  };
+
+  // How long the tasks of one priority waited in thread_pool's queues
+  // before a worker picked them up
+  struct queue_wait_stats final {
+    std::uint64_t tasks = 0;
+    std::chrono::nanoseconds total{0};
+    std::chrono::nanoseconds max{0};
+
+    std::chrono::nanoseconds mean() const {
+      return tasks > 0 ? total / static_cast<std::chrono::nanoseconds::rep>(tasks)
+                       : std::chrono::nanoseconds(0);
+    }
+  };
+
+  namespace internal {
+#if defined(__linux__)
+    // Returns the CPU limit imposed by the cgroup (v2 or v1) CPU quota,
+    // rounded up, or 0 if there is no quota
+    inline unsigned int cgroup_cpu_limit() {
+      long long quota = -1;
+      long long period = 0;
+
+      std::ifstream cpu_max("/sys/fs/cgroup/cpu.max");
+      std::string max;
+      if (cpu_max >> max >> period) {
+        if (max != "max") {
+          quota = std::stoll(max);
+        }
+      } else {
+        std::ifstream quota_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+        std::ifstream period_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+        if (!(quota_file >> quota) || !(period_file >> period)) {
+          return 0;
+        }
+      }
+
+      if (quota <= 0 || period <= 0) {
+        return 0;
+      }
+      return static_cast<unsigned int>((quota + period - 1) / period);
+    }
+#endif
+
+    // A CPU and where it sits in the machine
+    struct cpu_info {
+      unsigned int id;
+      int package;
+      int core;
+      // Position among the hardware threads of its core
+      unsigned int smt_index;
+      // NUMA node as numbered by the kernel
+      int node = 0;
+    };
+
+    // Parse a CPU list like "0-3,8,10-11" as found in sysfs
+    inline std::vector<unsigned int> parse_cpu_list(const std::string& list) {
+      std::vector<unsigned int> cpus;
+      std::size_t pos = 0;
+      while (pos < list.size()) {
+        const std::size_t end = std::min(list.find(',', pos), list.size());
+        const std::string range = list.substr(pos, end - pos);
+        const std::size_t dash = range.find('-');
+        try {
+          const unsigned long first = std::stoul(range.substr(0, dash));
+          const unsigned long last =
+              dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+          for (unsigned long cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(static_cast<unsigned int>(cpu));
+          }
+        } catch (std::exception&) {
+          // Skip what we do not understand
+        }
+        pos = end + 1;
+      }
+      return cpus;
+    }
+
+#if defined(__linux__)
+    // Topology of the CPUs this process may run on, from
+    // /sys/devices/system/cpu; CPUs without topology information count as
+    // cores of their own
+    inline std::vector<cpu_info> read_cpu_topology() {
+      std::vector<cpu_info> cpus;
+      cpu_set_t set;
+      if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return cpus;
+      }
+
+      for (unsigned int id = 0; id < CPU_SETSIZE; ++id) {
+        if (!CPU_ISSET(id, &set)) {
+          continue;
+        }
+
+        const std::string topology =
+            "/sys/devices/system/cpu/cpu" + std::to_string(id) + "/topology/";
+        cpu_info cpu{id, 0, static_cast<int>(id), 0};
+        std::ifstream package(topology + "physical_package_id");
+        std::ifstream core(topology + "core_id");
+        if (!(package >> cpu.package) || !(core >> cpu.core)) {
+          cpu.package = 0;
+          cpu.core = static_cast<int>(id);
+        }
+
+        std::ifstream siblings_file(topology + "thread_siblings_list");
+        std::string siblings;
+        if (siblings_file >> siblings) {
+          for (const auto sibling : parse_cpu_list(siblings)) {
+            if (sibling < id) {
+              ++cpu.smt_index;
+            }
+          }
+        }
+        cpus.push_back(cpu);
+      }
+
+      std::ifstream possible_file("/sys/devices/system/node/possible");
+      std::string possible;
+      if (possible_file >> possible) {
+        for (const auto node : parse_cpu_list(possible)) {
+          std::ifstream cpulist_file("/sys/devices/system/node/node" + std::to_string(node) +
+                                     "/cpulist");
+          std::string cpulist;
+          if (!(cpulist_file >> cpulist)) {
+            continue;
+          }
+          for (const auto id : parse_cpu_list(cpulist)) {
+            for (auto& cpu : cpus) {
+              if (cpu.id == id) {
+                cpu.node = static_cast<int>(node);
+              }
+            }
+          }
+        }
+      }
+      return cpus;
+    }
+#endif
+
+    // The CPUs of every NUMA node that has any in cpus, lowest node first
+    inline std::vector<std::vector<unsigned int>> numa_nodes(std::vector<cpu_info> cpus) {
+      std::sort(cpus.begin(), cpus.end(), [](const cpu_info& a, const cpu_info& b) {
+        return std::tie(a.node, a.id) < std::tie(b.node, b.id);
+      });
+      std::vector<std::vector<unsigned int>> nodes;
+      for (std::size_t i = 0; i < cpus.size(); ++i) {
+        if (i == 0 || cpus[i].node != cpus[i - 1].node) {
+          nodes.emplace_back();
+        }
+        nodes.back().push_back(cpus[i].id);
+      }
+      return nodes;
+    }
+
+    // NUMA nodes to group the workers of a pool by; empty unless asked for
+    // and supported
+    inline std::vector<std::vector<unsigned int>> worker_nodes(bool numa_aware) {
+#if defined(__linux__)
+      if (numa_aware) {
+        return numa_nodes(read_cpu_topology());
+      }
+#else
+      (void)numa_aware;
+#endif
+      return std::vector<std::vector<unsigned int>>();
+    }
+
+    // The CPUs to pin workers to, in order; worker i goes to element
+    // i % size(). Empty for affinity_policy::none.
+    inline std::vector<unsigned int> placement_order(std::vector<cpu_info> cpus,
+                                                     affinity_policy policy) {
+      std::vector<unsigned int> order;
+      if (policy == affinity_policy::none || cpus.empty()) {
+        return order;
+      }
+
+      std::sort(cpus.begin(), cpus.end(), [](const cpu_info& a, const cpu_info& b) {
+        return std::tie(a.package, a.core, a.smt_index, a.id) <
+               std::tie(b.package, b.core, b.smt_index, b.id);
+      });
+
+      switch (policy) {
+      case affinity_policy::compact:
+        break;
+
+      case affinity_policy::skip_smt:
+        cpus.erase(std::remove_if(cpus.begin(), cpus.end(),
+                                  [](const cpu_info& cpu) { return cpu.smt_index > 0; }),
+                   cpus.end());
+        break;
+
+      case affinity_policy::scatter: {
+        // Rank the cores of every package, then take the first thread of
+        // core 0 of every package, of core 1, and so on; siblings come last
+        std::vector<std::size_t> rank(cpus.size());
+        for (std::size_t i = 0, r = 0; i < cpus.size(); ++i) {
+          if (i > 0 && cpus[i].package != cpus[i - 1].package) {
+            r = 0;
+          } else if (i > 0 && cpus[i].core != cpus[i - 1].core) {
+            ++r;
+          }
+          rank[i] = r;
+        }
+        std::vector<std::size_t> indices(cpus.size());
+        for (std::size_t i = 0; i < indices.size(); ++i) {
+          indices[i] = i;
+        }
+        std::stable_sort(indices.begin(), indices.end(), [&](std::size_t a, std::size_t b) {
+          return std::tie(cpus[a].smt_index, rank[a]) < std::tie(cpus[b].smt_index, rank[b]);
+        });
+        std::vector<cpu_info> scattered;
+        for (const auto i : indices) {
+          scattered.push_back(cpus[i]);
+        }
+        cpus = std::move(scattered);
+        break;
+      }
+
+      case affinity_policy::none:
+        break;
+      }
+
+      for (const auto& cpu : cpus) {
+        order.push_back(cpu.id);
+      }
+      return order;
+    }
+
+    // CPUs to pin the workers of a pool to under policy; empty if we
+    // cannot pin threads here
+    inline std::vector<unsigned int> worker_placement(affinity_policy policy) {
+#if defined(__linux__)
+      return placement_order(read_cpu_topology(), policy);
+#else
+      (void)policy;
+      return std::vector<unsigned int>();
+#endif
+    }
+
+    // Restrict thread to cpus; best effort
+    inline void pin_thread(std::thread::native_handle_type thread,
+                           const std::vector<unsigned int>& cpus) {
+#if defined(__linux__)
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (const auto cpu : cpus) {
+        CPU_SET(cpu, &set);
+      }
+      pthread_setaffinity_np(thread, sizeof(set), &set);
+#else
+      (void)thread;
+      (void)cpus;
+#endif
+    }
+
+    // Hint to the CPU that the calling thread is spinning
+    inline void cpu_relax() noexcept {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+      _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#elif defined(__aarch64__)
+      asm volatile("yield");
+#endif
+    }
+
+    // Task that resumes a suspended coroutine. A pool that stops drops the
+    // tasks it still has queued; this one then resumes the coroutine
+    // anyway, on the dropping thread, after setting *dropped if given, so
+    // the coroutine neither leaks nor leaves its awaiter hanging.
+    template <typename Handle> class resumer final {
+    public:
+      resumer(Handle handle, bool* dropped) noexcept : handle_(handle), dropped_(dropped) {}
+
+      resumer(resumer&& other) noexcept
+          : handle_(std::exchange(other.handle_, nullptr)), dropped_(other.dropped_) {}
+
+      resumer& operator=(resumer&&) = delete;
+      resumer(const resumer&) = delete;
+      resumer& operator=(const resumer&) = delete;
+
+      ~resumer() {
+        if (handle_) {
+          if (dropped_) {
+            *dropped_ = true;
+          }
+          handle_.resume();
+        }
+      }
+
+      void operator()() { std::exchange(handle_, nullptr).resume(); }
+
+    private:
+      Handle handle_;
+      bool* dropped_;
+    };
+
+    // Name the calling thread; best effort
+    inline void set_current_thread_name(const std::string& name) {
+#if defined(__linux__)
+      pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+#elif defined(__APPLE__)
+      pthread_setname_np(name.c_str());
+#else
+      (void)name;
+#endif
+    }
+
+    class pool_access;
+  } // namespace internal
+
+  // Returns the number of threads that can actually run in parallel: the
+  // hardware concurrency, narrowed by the CPU affinity mask and the cgroup
+  // CPU quota on Linux; at least 1
+  inline unsigned int default_thread_count() {
+    unsigned int count = std::thread::hardware_concurrency();
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+      const auto affinity = static_cast<unsigned int>(CPU_COUNT(&set));
+      if (affinity > 0 && (count == 0 || affinity < count)) {
+        count = affinity;
+      }
+    }
+    const unsigned int quota = internal::cgroup_cpu_limit();
+    if (quota > 0 && (count == 0 || quota < count)) {
+      count = quota;
+    }
+#endif
+    return count > 0 ? count : 1U;
+  }
+
+  // A work-stealing thread pool. Slightly adapted from C++ Concurrency in
+  // Action, chapter 9.
+  //
+  // Every worker owns a work_stealing_queue; tasks submitted from a worker
+  // go to its own queue, tasks submitted from other threads go to a global
+  // injection queue. An idle worker first drains its own queue, then the
+  // injection queue, then steals from the other workers.
+  //
+  // Tasks submitted with a priority other than normal always go to one of
+  // the per-priority injection queues. High priority tasks run before
+  // anything else, background tasks only when nothing else is queued;
+  // tasks that wait long enough are promoted (see priority_aging).
+  //
+  // Tasks submitted with a deadline are kept apart and run earliest
+  // deadline first, ahead of all other tasks. Once its deadline has passed,
+  // a task is dropped instead of run.
+  //
+  // Delayed and periodic tasks wait in a timer wheel driven by a timer
+  // thread of their own, which is started on first use; no worker is
+  // blocked while they wait.
+  //
+  // submit() returns a foo::future; continuations attached with then() are
+  // queued on the pool once the result is ready. A worker waiting for a
+  // future runs other pending tasks in the meantime, so tasks may wait for
+  // subtasks without tying up the pool.
+  //
+  // With numa_aware, workers are split into one group per NUMA node and
+  // kept on that node's CPUs. Every group has an injection queue of its
+  // own, which submissions with a node_hint go to. An idle worker steals
+  // from the workers of its own node before those of other nodes.
+  //
+  // The pool starts options.thread_count workers. If max_thread_count is
+  // larger, submit() adds workers while the pool is saturated, and those
+  // extra workers retire again after keep_alive without work.
+  class thread_pool final {
+  public:
+    typedef interruptible_thread thread_type;
+    typedef unique_task task_type;
+
+    thread_pool() : thread_pool(thread_pool_options()) {}
+
+    explicit thread_pool(thread_pool_options options)
+        : options_(std::move(options)),
+          core_size_(options_.thread_count > 0 ? options_.thread_count : default_thread_count()),
+          max_size_(std::max<std::size_t>(core_size_, options_.max_thread_count)),
+          placement_(internal::worker_placement(options_.affinity)),
+          nodes_(internal::worker_nodes(options_.numa_aware)), done_(false),
+          pending_(0), submitted_(0), idle_(0), helpers_(0), size_(0), high_water_mark_(0),
+          last_dequeue_(std::chrono::steady_clock::now().time_since_epoch().count()),
+          next_aging_(0), global_tasks_(), queued_(), node_tasks_(), waits_(), room_mutex_(),
+          room_cond_(), blocked_submitters_(0), overflow_counts_(), deadline_mutex_(),
+          deadline_tasks_(), deadline_count_(0), deadline_sequence_(0),
+          states_(std::make_unique<worker_state[]>(max_size_)), help_mutex_(),
+          help_cond_(), resize_mutex_(), timer_mutex_(), timer_cond_(),
+          timers_(options_.timer_resolution),
+          timer_next_(std::chrono::steady_clock::time_point::max()), timer_changed_(false),
+          timer_started_(false), timer_thread_(), workers_(), joiner_(workers_) {
+      try {
+        for (std::size_t i = 0; i < max_size_; ++i) {
+          states_[i].node = node_of_worker(i);
+          states_[i].batch.reserve(max_pop_batch);
+        }
+        for (std::size_t i = 0; i < node_count(); ++i) {
+          node_tasks_.push_back(std::make_unique<node_queue>());
+        }
+        if (options_.injection == injection_policy::lock_free) {
+          for (auto& queue : global_tasks_) {
+            queue.make_lock_free(options_.injection_capacity);
+          }
+          for (auto& node : node_tasks_) {
+            node->tasks.make_lock_free(options_.injection_capacity);
+          }
+        }
+        // Slots are never reallocated, so workers can be added later without
+        // invalidating anything the running workers look at
+        workers_.resize(max_size_);
+
+        std::lock_guard<std::mutex> guard(resize_mutex_);
+        for (std::size_t i = 0; i < core_size_; ++i) {
+          spawn_worker(i);
+        }
+      } catch (std::exception&) {
+        stop();
+        throw;
+      }
+    }
+
+    // Join all worker threads and clean-up
+    ~thread_pool() {
+      stop();
+      if (timer_thread_.joinable()) {
+        timer_thread_.join();
+      }
+
+      // joiner_ will take care of joining
+    }
+
+    template <typename Function, typename... Args>
+    auto submit(Function&& function, Args&&... args) // URef
+        -> future<std::invoke_result_t<Function, Args...>> {
+      typedef std::invoke_result_t<Function, Args...> result_type;
+
+      if (done_) {
+        throw std::runtime_error("submit on stopped thread_pool");
+      }
+
+      promise<result_type> promise(continuation_executor());
+      future<result_type> result = promise.get_future();
+      admit_and_push(make_task(std::move(promise), std::forward<Function>(function),
+                               std::forward<Args>(args)...),
+                     [this](task_type task) {
+                       push_task(std::move(task), task_priority::normal, true);
+                     });
+      return result;
+    }
+
+    // Like submit(function, args...), with a priority
+    template <typename Function, typename... Args>
+    auto submit(task_priority priority, Function&& function, Args&&... args)
+        -> future<std::invoke_result_t<Function, Args...>> {
+      typedef std::invoke_result_t<Function, Args...> result_type;
+
+      if (done_) {
+        throw std::runtime_error("submit on stopped thread_pool");
+      }
+
+      promise<result_type> promise(continuation_executor());
+      future<result_type> result = promise.get_future();
+      admit_and_push(make_task(std::move(promise), std::forward<Function>(function),
+                               std::forward<Args>(args)...),
+                     [this, priority](task_type task) {
+                       push_task(std::move(task), priority, true);
+                     });
+      return result;
+    }
+
+    // Submit a task that is only worth running until deadline
+    //
+    // Deadline tasks run earliest deadline first, before any other task. If
+    // the deadline has passed by the time a worker gets to the task, the
+    // function is not called and the future holds deadline_exceeded.
+    // Their queue wait is counted as high priority.
+    template <typename Function, typename... Args>
+    auto submit(std::chrono::steady_clock::time_point deadline, Function&& function,
+                Args&&... args) -> future<std::invoke_result_t<Function, Args...>> {
+      typedef std::invoke_result_t<Function, Args...> result_type;
+
+      if (done_) {
+        throw std::runtime_error("submit on stopped thread_pool");
+      }
+
+      promise<result_type> promise(continuation_executor());
+      future<result_type> result = promise.get_future();
+      task_type task = [deadline, promise = std::move(promise),
+                        function = std::forward<Function>(function),
+                        arguments = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+        if (std::chrono::steady_clock::now() > deadline) {
+          promise.set_exception(std::make_exception_ptr(deadline_exceeded()));
+          return;
+        }
+        internal::fulfil(promise, [&]() -> result_type {
+          return std::apply(std::move(function), std::move(arguments));
+        });
+      };
+      admit_and_push(std::move(task), [this, deadline](task_type queued) {
+        push_deadline_task(deadline, std::move(queued));
+      });
+      return result;
+    }
+
+    // Like submit(function, args...), preferably run on a worker of the
+    // node hint names; hints beyond node_count() wrap around
+    template <typename Function, typename... Args>
+    auto submit(node_hint hint, Function&& function, Args&&... args)
+        -> future<std::invoke_result_t<Function, Args...>> {
+      typedef std::invoke_result_t<Function, Args...> result_type;
+
+      if (done_) {
+        throw std::runtime_error("submit on stopped thread_pool");
+      }
+
+      promise<result_type> promise(continuation_executor());
+      future<result_type> result = promise.get_future();
+      admit_and_push(make_task(std::move(promise), std::forward<Function>(function),
+                               std::forward<Args>(args)...),
+                     [this, hint](task_type task) { push_node_task(std::move(task), hint); });
+      return result;
+    }
+
+    // Awaitable that resumes the awaiting coroutine on one of the workers,
+    // as in co_await pool.schedule(); see coroutine.hpp
+    //
+    // On a stopped pool, or one that stops before a worker got to the
+    // coroutine, the co_await throws std::runtime_error instead.
+    class schedule_operation final {
+    public:
+      explicit schedule_operation(thread_pool& pool) noexcept : pool_(pool), stopped_(false) {}
+
+      bool await_ready() const noexcept { return false; }
+
+      // Failing to queue the resumption leaves no way back into the
+      // coroutine that is safe, hence noexcept
+      template <typename Handle> bool await_suspend(Handle handle) noexcept {
+        if (pool_.done_) {
+          stopped_ = true;
+          return false;
+        }
+        pool_.push_task(internal::resumer<Handle>(handle, &stopped_));
+        return true;
+      }
+
+      void await_resume() const {
+        if (stopped_) {
+          throw std::runtime_error("schedule on stopped thread_pool");
+        }
+      }
+
+    private:
+      thread_pool& pool_;
+      bool stopped_;
+    };
+
+    schedule_operation schedule() noexcept { return schedule_operation(*this); }
+
+    // Run function(args...) on the pool without a future to report back
+    //
+    // Only the callable and its arguments are queued, so this is cheaper
+    // than submit() when nobody waits for the result. The result is
+    // discarded; exceptions go to options().exception_handler.
+    template <typename Function, typename... Args> void post(Function&& function, Args&&... args) {
+      if (done_) {
+        throw std::runtime_error("post on stopped thread_pool");
+      }
+
+      admit_and_push(make_post_task(std::forward<Function>(function), std::forward<Args>(args)...),
+                     [this](task_type task) {
+                       push_task(std::move(task), task_priority::normal, true);
+                     });
+    }
+
+    // Like post(function, args...), preferably run on a worker of the node
+    // hint names
+    template <typename Function, typename... Args>
+    void post(node_hint hint, Function&& function, Args&&... args) {
+      if (done_) {
+        throw std::runtime_error("post on stopped thread_pool");
+      }
+
+      admit_and_push(make_post_task(std::forward<Function>(function), std::forward<Args>(args)...),
+                     [this, hint](task_type task) { push_node_task(std::move(task), hint); });
+    }
+
+    // Run function(args...) on the pool once delay has passed
+    //
+    // The result of function is discarded; exceptions go to
+    // options().exception_handler. The returned handle can cancel the task
+    // before it runs.
+    template <typename Rep, typename Period, typename Function, typename... Args>
+    timer_handle schedule_after(std::chrono::duration<Rep, Period> delay, Function&& function,
+                                Args&&... args) {
+      return schedule_at(std::chrono::steady_clock::now() + delay,
+                         std::forward<Function>(function), std::forward<Args>(args)...);
+    }
+
+    // Run function(args...) on the pool once time has come; see
+    // schedule_after
+    template <typename Function, typename... Args>
+    timer_handle schedule_at(std::chrono::steady_clock::time_point time, Function&& function,
+                             Args&&... args) {
+      return schedule_timer(time, std::chrono::steady_clock::duration::zero(),
+                            make_repeatable_task(std::forward<Function>(function),
+                                                 std::forward<Args>(args)...));
+    }
+
+    // Run function(args...) on the pool every period, starting one period
+    // from now, until the returned handle is cancelled
+    //
+    // Runs of the same task never overlap: the next run is scheduled when
+    // the previous one returns, one period after it was due or right away
+    // if it overran. Results are discarded, exceptions go to
+    // options().exception_handler.
+    template <typename Rep, typename Period, typename Function, typename... Args>
+    timer_handle schedule_every(std::chrono::duration<Rep, Period> period, Function&& function,
+                                Args&&... args) {
+      const auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+      if (interval <= std::chrono::steady_clock::duration::zero()) {
+        throw std::invalid_argument("schedule_every requires a positive period");
+      }
+      return schedule_timer(std::chrono::steady_clock::now() + interval, interval,
+                            make_repeatable_task(std::forward<Function>(function),
+                                                 std::forward<Args>(args)...));
+    }
+
+    // Submit function(element) for every element in [first, last); the
+    // elements are copied into the tasks
+    //
+    // All tasks are queued under a single lock and at most one idle worker
+    // per task is woken up.
+    template <typename InputIt, typename Function,
+              typename Result = std::invoke_result_t<
+                  Function, typename std::iterator_traits<InputIt>::value_type>>
+    std::vector<future<Result>> submit_bulk(InputIt first, InputIt last, Function function) {
+      if (done_) {
+        throw std::runtime_error("submit on stopped thread_pool");
+      }
+
+      const auto now = std::chrono::steady_clock::now();
+      std::vector<queued_task> tasks;
+      std::vector<future<Result>> results;
+      for (; first != last; ++first) {
+        promise<Result> promise(continuation_executor());
+        results.push_back(promise.get_future());
+        tasks.push_back(
+            {make_task(std::move(promise), function, *first), now, task_priority::normal, true});
+      }
+      if (admit(tasks.size())) {
+        push_tasks(tasks);
+      } else {
+        for (auto& entry : tasks) {
+          entry.task();
+        }
+      }
+      return results;
+    }
+
+    // Submit every callable in callables; like submit_bulk(first, last,
+    // function), the whole batch is queued under a single lock. The
+    // callables are moved out of the range if it is an rvalue.
+    template <typename Range,
+              typename Callable = std::decay_t<decltype(*std::begin(std::declval<Range&>()))>,
+              typename Result = std::invoke_result_t<Callable>>
+    std::vector<future<Result>> submit_bulk(Range&& callables) {
+      if (done_) {
+        throw std::runtime_error("submit on stopped thread_pool");
+      }
+
+      const auto now = std::chrono::steady_clock::now();
+      std::vector<queued_task> tasks;
+      std::vector<future<Result>> results;
+      for (auto&& callable : callables) {
+        promise<Result> promise(continuation_executor());
+        results.push_back(promise.get_future());
+        if constexpr (std::is_lvalue_reference<Range>::value) {
+          tasks.push_back({make_task(std::move(promise), callable), now,
+                           task_priority::normal, true});
+        } else {
+          tasks.push_back({make_task(std::move(promise), std::move(callable)), now,
+                           task_priority::normal, true});
+        }
+      }
+      if (admit(tasks.size())) {
+        push_tasks(tasks);
+      } else {
+        for (auto& entry : tasks) {
+          entry.task();
+        }
+      }
+      return results;
+    }
+
+    // Run one pending task on the calling thread; returns false if there
+    // was nothing to run
+    //
+    // Looks for deadline and high priority tasks first, then at the calling
+    // worker's own queue, then the normal injection queue, then tries to
+    // steal from the other workers and nodes, and takes a background task
+    // only when all of that came up empty. May also be called from threads
+    // outside the pool.
+    bool run_pending_task() {
+      queued_task entry;
+      if (pop_task_from_deadline_queue(entry) ||
+          pop_task_from_global_queue(entry, task_priority::high) ||
+          pop_task_from_local_queue(entry) || pop_task_from_node_queue(entry, true) ||
+          pop_task_from_global_queue(entry, task_priority::normal) ||
+          pop_task_from_other_thread_queue(entry) || pop_task_from_node_queue(entry, false) ||
+          pop_task_from_global_queue(entry, task_priority::background)) {
+        pending_.fetch_sub(1);
+        if (entry.submitted) {
+          submitted_.fetch_sub(1);
+        }
+        if (blocked_submitters_.load() > 0) {
+          std::lock_guard<std::mutex> guard(room_mutex_);
+          room_cond_.notify_all();
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        record_wait(entry, now);
+        if (is_elastic()) {
+          last_dequeue_.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+        }
+        age_queued_tasks(now);
+
+        entry.task();
+        return true;
+      }
+      return false;
+    }
+
+    // Queue wait times of the tasks submitted with priority so far
+    queue_wait_stats queue_wait(task_priority priority) const {
+      const auto level = static_cast<std::size_t>(priority);
+      queue_wait_stats stats;
+      const auto add = [&stats](const wait_counters& counters) {
+        stats.tasks += counters.tasks.load(std::memory_order_relaxed);
+        stats.total += std::chrono::nanoseconds(counters.total.load(std::memory_order_relaxed));
+        const std::chrono::nanoseconds max(counters.max.load(std::memory_order_relaxed));
+        stats.max = std::max(stats.max, max);
+      };
+      add(waits_[level]);
+      for (std::size_t i = 0; i < max_size_; ++i) {
+        add(states_[i].waits[level]);
+      }
+      return stats;
+    }
+
+    // Number of worker threads currently running
+    std::size_t size() const { return size_.load(); }
+
+    // What became of submissions under queue_capacity so far
+    overflow_stats overflow() const {
+      overflow_stats stats;
+      stats.accepted = overflow_counts_[accepted].load(std::memory_order_relaxed);
+      stats.blocked = overflow_counts_[blocked].load(std::memory_order_relaxed);
+      stats.caller_ran = overflow_counts_[caller_ran].load(std::memory_order_relaxed);
+      stats.rejected = overflow_counts_[rejected].load(std::memory_order_relaxed);
+      stats.dropped = overflow_counts_[dropped].load(std::memory_order_relaxed);
+      return stats;
+    }
+
+    // Number of NUMA nodes the workers are grouped by; 1 unless numa_aware
+    std::size_t node_count() const { return nodes_.empty() ? 1 : nodes_.size(); }
+
+    // Largest number of worker threads that ever ran at the same time
+    std::size_t high_water_mark() const { return high_water_mark_.load(); }
+
+    const thread_pool_options& options() const { return options_; }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+  private:
+    friend class internal::pool_access;
+
+    // Ensures we join our worker threads at scope exit.
+    class join_threads {
+    public:
+      explicit join_threads(std::vector<thread_type>& threads) : threads_(threads) {}
+
+      ~join_threads() {
+        for (auto& t : threads_) {
+          if (t.joinable()) {
+            t.join();
+          }
+        }
+      }
+
+    private:
+      std::vector<thread_type>& threads_;
+    };
+
+    // Keeps helpers_ up to date while a thread waits, even if it is
+    // interrupted
+    class idle_guard {
+    public:
+      explicit idle_guard(std::atomic<std::size_t>& idle) : idle_(idle) { idle_.fetch_add(1); }
+      ~idle_guard() { idle_.fetch_sub(1); }
+
+      idle_guard(const idle_guard&) = delete;
+      idle_guard& operator=(const idle_guard&) = delete;
+
+    private:
+      std::atomic<std::size_t>& idle_;
+    };
+
+    // Marks a worker as parked, and counts it in idle_, while it waits,
+    // even if it is interrupted
+    class park_guard {
+    public:
+      park_guard(std::atomic<bool>& parked, std::atomic<std::size_t>& idle)
+          : parked_(parked), idle_(idle) {
+        parked_.store(true);
+        idle_.fetch_add(1);
+      }
+
+      ~park_guard() {
+        parked_.store(false);
+        idle_.fetch_sub(1);
+      }
+
+      park_guard(const park_guard&) = delete;
+      park_guard& operator=(const park_guard&) = delete;
+
+    private:
+      std::atomic<bool>& parked_;
+      std::atomic<std::size_t>& idle_;
+    };
+
+    static constexpr std::size_t priority_levels = 3;
+    static constexpr std::size_t normal_level = static_cast<std::size_t>(task_priority::normal);
+    // Most tasks a worker takes off the normal injection queue at once
+    static constexpr std::size_t max_pop_batch = 16;
+    // How long an idle worker spins, and then yields, before it parks
+    static constexpr std::size_t spin_rounds = 64;
+    static constexpr std::size_t yield_rounds = 16;
+
+    // A task as it sits in one of the queues
+    struct queued_task {
+      task_type task;
+      std::chrono::steady_clock::time_point enqueued;
+      // What the task was submitted with; it may have been promoted since
+      task_priority priority = task_priority::normal;
+      // Whether it came from submit() or post(); only those count against
+      // queue_capacity, and only those may be dropped to make room
+      bool submitted = false;
+    };
+
+    // A task in the earliest-deadline-first heap
+    struct deadline_task {
+      std::chrono::steady_clock::time_point deadline;
+      // Keeps tasks with equal deadlines in submission order
+      std::uint64_t sequence;
+      queued_task entry;
+
+      // Orders the heap so the earliest deadline is on top
+      bool operator<(const deadline_task& rhs) const {
+        return deadline != rhs.deadline ? deadline > rhs.deadline : sequence > rhs.sequence;
+      }
+    };
+
+    // A task waiting for its time in the timer wheel
+    struct timer_state {
+      std::atomic<bool> cancelled{false};
+      task_type function;
+      std::chrono::steady_clock::time_point due;
+      // Zero for tasks that run only once
+      std::chrono::steady_clock::duration period;
+    };
+
+    // Queue wait statistics of one priority, in nanoseconds
+    struct wait_counters {
+      std::atomic<std::uint64_t> tasks{0};
+      std::atomic<std::int64_t> total{0};
+      std::atomic<std::int64_t> max{0};
+    };
+
+    // Injection queue as options.injection asks for: a locked_queue, or an
+    // mpmc_queue that spills over into the locked_queue while it is full.
+    // Once something spilled over, pushes keep going to the locked_queue
+    // until it is empty again, so spilled tasks are not overtaken by later
+    // ones. Aligned so neighbouring queues do not share cache lines.
+    class alignas(internal::cache_line_size) task_queue final {
+    public:
+      task_queue() : ring_(), spill_(), spilled_(0), held_mutex_(), held_(), holding_(false) {}
+
+      // Call before the queue is used
+      void make_lock_free(std::size_t capacity) {
+        ring_ = std::make_unique<mpmc_queue<queued_task>>(capacity);
+      }
+
+      void push(queued_task entry) {
+        if (!ring_) {
+          spill_.push(std::move(entry));
+          return;
+        }
+        if (spilled_.load() == 0 && ring_->try_push(entry)) {
+          return;
+        }
+        // Counted before it becomes visible, like pending_
+        spilled_.fetch_add(1);
+        spill_.push(std::move(entry));
+      }
+
+      template <typename InputIt> void push_bulk(InputIt first, InputIt last) {
+        if (!ring_) {
+          spill_.push_bulk(first, last);
+          return;
+        }
+        for (; first != last; ++first) {
+          push(std::move(*first));
+        }
+      }
+
+      bool try_pop(queued_task& entry) {
+        if (!ring_) {
+          return spill_.try_pop(entry);
+        }
+        if (holding_.load()) {
+          std::lock_guard<std::mutex> guard(held_mutex_);
+          if (holding_.load()) {
+            entry = std::move(held_);
+            holding_.store(false);
+            return true;
+          }
+        }
+        return ring_->try_pop(entry) || try_pop_spilled(entry);
+      }
+
+      template <typename OutputIt> std::size_t try_pop_bulk(OutputIt out, std::size_t max) {
+        if (!ring_) {
+          return spill_.try_pop_bulk(out, max);
+        }
+        std::size_t count = 0;
+        queued_task entry;
+        for (; count < max && try_pop(entry); ++count) {
+          *out = std::move(entry);
+          ++out;
+        }
+        return count;
+      }
+
+      // The ring has no front to look at, so the front entry gets taken out
+      // and held on to until pred accepts it; try_pop() still hands it out
+      // first
+      template <typename Predicate> bool try_pop_if(queued_task& entry, Predicate pred) {
+        if (!ring_) {
+          return spill_.try_pop_if(entry, pred);
+        }
+        std::lock_guard<std::mutex> guard(held_mutex_);
+        if (!holding_.load()) {
+          if (!ring_->try_pop(held_) && !try_pop_spilled(held_)) {
+            return false;
+          }
+          holding_.store(true);
+        }
+        if (!pred(static_cast<const queued_task&>(held_))) {
+          return false;
+        }
+        entry = std::move(held_);
+        holding_.store(false);
+        return true;
+      }
+
+      task_queue(const task_queue&) = delete;
+      task_queue& operator=(const task_queue&) = delete;
+
+    private:
+      bool try_pop_spilled(queued_task& entry) {
+        if (spilled_.load() == 0 || !spill_.try_pop(entry)) {
+          return false;
+        }
+        spilled_.fetch_sub(1);
+        return true;
+      }
+
+      std::unique_ptr<mpmc_queue<queued_task>> ring_;
+      locked_queue<queued_task> spill_;
+      // Tasks in spill_ while there is a ring
+      std::atomic<std::size_t> spilled_;
+      // Front entry taken out by try_pop_if
+      std::mutex held_mutex_;
+      queued_task held_;
+      std::atomic<bool> holding_;
+    };
+
+    // Injection queue of a NUMA node
+    struct alignas(internal::cache_line_size) node_queue {
+      task_queue tasks;
+      std::atomic<std::size_t> queued{0};
+    };
+
+    // What the pool keeps per worker slot. Each sits on cache lines of its
+    // own, so workers busy with their own slots do not slow each other down.
+    struct alignas(internal::cache_line_size) worker_state {
+      work_stealing_queue<queued_task> tasks;
+      // Queue waits of the tasks this worker ran, by priority
+      std::array<wait_counters, priority_levels> waits;
+      // Scratch space of pop_batch_from_global_queue
+      std::vector<queued_task> batch;
+      // NUMA node, as index into nodes_
+      std::size_t node = 0;
+      // Whether a thread currently runs in this slot; guarded by
+      // resize_mutex_
+      bool active = false;
+      // Where the worker parks. Set while it waits, cleared by whoever
+      // wakes it; on a line of its own, as wake_workers() reads it in
+      // every slot while the owners keep using their queues.
+      alignas(internal::cache_line_size) std::atomic<bool> parked{false};
+      std::mutex park_mutex;
+      std::condition_variable_any park_cond;
+    };
+
+    bool is_worker() const { return current_pool_ == this; }
+
+    // Wrap function(args...) into a task that fulfils promise; the callable
+    // and its arguments travel inside the task itself, so only the future's
+    // shared state is allocated
+    template <typename Result, typename Function, typename... Args>
+    static task_type make_task(promise<Result> promise, Function&& function, Args&&... args) {
+      return [promise = std::move(promise), function = std::forward<Function>(function),
+              arguments = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+        internal::fulfil(promise, [&]() -> Result {
+          return std::apply(std::move(function), std::move(arguments));
+        });
+      };
+    }
+
+    void handle_exception(std::exception_ptr error) const noexcept {
+      if (options_.exception_handler) {
+        try {
+          options_.exception_handler(std::move(error));
+        } catch (...) {
+          // Nobody left to report to
+        }
+      }
+    }
+
+    // Lets futures waited for on a worker run pending tasks meanwhile
+    static bool help(void* context) {
+      return static_cast<thread_pool*>(context)->run_pending_task();
+    }
+
+    static void park(void* context, bool (*ready)(const void*), const void* state,
+                     std::chrono::steady_clock::time_point deadline) {
+      static_cast<thread_pool*>(context)->park_helper([ready, state] { return ready(state); },
+                                                      deadline);
+    }
+
+    static void wake(void* context) { static_cast<thread_pool*>(context)->wake_helpers(); }
+
+    // Run pending tasks on the calling thread until ready() returns true,
+    // parking while there are none; whoever makes ready() true must call
+    // wake_helpers() after
+    template <typename Predicate> void help_until(Predicate ready) {
+      while (!ready()) {
+        if (!run_pending_task()) {
+          park_helper(ready, std::chrono::steady_clock::time_point::max());
+        }
+      }
+    }
+
+    // Park the calling thread until ready() returns true, a task may be
+    // waiting or deadline passed. Like the workers in wait_for_task() do
+    // in idle_, helpers register in helpers_ before checking, so pushes
+    // and wake_helpers() notice them. Both read helpers_ right after their
+    // write, so ready() must read what its writer wrote with seq_cst.
+    template <typename Predicate>
+    void park_helper(Predicate ready, std::chrono::steady_clock::time_point deadline) {
+      std::unique_lock<std::mutex> lock(help_mutex_);
+      idle_guard guard(helpers_);
+      const auto woken = [this, &ready] { return ready() || pending_.load() > 0; };
+      if (deadline == std::chrono::steady_clock::time_point::max()) {
+        help_cond_.wait(lock, woken);
+      } else {
+        help_cond_.wait_until(lock, deadline, woken);
+      }
+    }
+
+    // Have the threads in park_helper check their predicates again
+    void wake_helpers() {
+      if (helpers_.load() > 0) {
+        std::lock_guard<std::mutex> guard(help_mutex_);
+        help_cond_.notify_all();
+      }
+    }
+
+    // Continuations of the futures this pool hands out are queued on it
+    internal::executor_ref continuation_executor() {
+      return internal::executor_ref{this, &thread_pool::execute_continuation};
+    }
+
+    static void execute_continuation(void* context, task_type task) {
+      auto* pool = static_cast<thread_pool*>(context);
+      // Dropping the task breaks its promise, and so on down the chain
+      if (!pool->done_) {
+        pool->push_task(std::move(task));
+      }
+    }
+
+    // Indices into overflow_counts_
+    enum overflow_outcome { accepted, blocked, caller_ran, rejected, dropped, overflow_outcomes };
+
+    void record_outcome(overflow_outcome outcome, std::size_t tasks) {
+      overflow_counts_[outcome].fetch_add(tasks, std::memory_order_relaxed);
+    }
+
+    bool has_room(std::size_t tasks) const {
+      const std::size_t queued = submitted_.load();
+      return queued == 0 || queued + tasks <= options_.queue_capacity;
+    }
+
+    // Apply queue_capacity to tasks about to be submitted; returns false if
+    // the caller is to run them instead of queuing them
+    bool admit(std::size_t tasks) {
+      if (options_.queue_capacity == 0) {
+        return true;
+      }
+      if (has_room(tasks)) {
+        record_outcome(accepted, tasks);
+        return true;
+      }
+
+      switch (options_.overflow) {
+      case overflow_policy::block:
+        if (is_worker()) {
+          // Waiting for ourselves could wait forever
+          record_outcome(caller_ran, tasks);
+          return false;
+        }
+        wait_for_room(tasks);
+        record_outcome(blocked, tasks);
+        return true;
+
+      case overflow_policy::caller_runs:
+        record_outcome(caller_ran, tasks);
+        return false;
+
+      case overflow_policy::reject:
+        record_outcome(rejected, tasks);
+        throw queue_full();
+
+      case overflow_policy::drop_oldest:
+        drop_oldest(tasks);
+        record_outcome(accepted, tasks);
+        return true;
+      }
+      return true;
+    }
+
+    template <typename Push> void admit_and_push(task_type task, Push push) {
+      if (admit(1)) {
+        push(std::move(task));
+      } else {
+        task();
+      }
+    }
+
+    void wait_for_room(std::size_t tasks) {
+      std::unique_lock<std::mutex> lock(room_mutex_);
+      blocked_submitters_.fetch_add(1);
+      const auto room = [this, tasks] { return done_ || has_room(tasks); };
+      bool found = true;
+      try {
+        if (options_.block_timeout.count() == 0) {
+          interruptible_wait(room_cond_, lock, room);
+        } else {
+          found = interruptible_wait_for(room_cond_, lock, options_.block_timeout, room);
+        }
+      } catch (...) {
+        blocked_submitters_.fetch_sub(1);
+        throw;
+      }
+      blocked_submitters_.fetch_sub(1);
+      if (!found) {
+        record_outcome(rejected, tasks);
+        throw queue_full();
+      }
+    }
+
+    // Drop up to tasks queued submissions, oldest and least important first.
+    // Only those at the front of a queue are up for it: tasks the pool
+    // queued itself have nobody to tell that they were dropped.
+    void drop_oldest(std::size_t tasks) {
+      const auto droppable = [](const queued_task& entry) { return entry.submitted; };
+      for (std::size_t i = 0; i < tasks; ++i) {
+        queued_task entry;
+        bool found = false;
+        for (std::size_t level = priority_levels; level-- > 0 && !found;) {
+          found = queued_[level].load() > 0 && global_tasks_[level].try_pop_if(entry, droppable);
+          if (found) {
+            queued_[level].fetch_sub(1);
+          }
+        }
+        for (std::size_t n = 0; n < node_tasks_.size() && !found; ++n) {
+          auto& queue = *node_tasks_[n];
+          found = queue.queued.load() > 0 && queue.tasks.try_pop_if(entry, droppable);
+          if (found) {
+            queue.queued.fetch_sub(1);
+          }
+        }
+        // The back of a worker's queue is its oldest task
+        for (std::size_t index = 0; index < max_size_ && !found; ++index) {
+          found = states_[index].tasks.try_steal_if(entry, droppable);
+        }
+        if (!found) {
+          return;
+        }
+
+        pending_.fetch_sub(1);
+        submitted_.fetch_sub(1);
+        record_outcome(dropped, 1);
+        // Breaks the task's promise, if it has one
+        entry.task.reset();
+      }
+    }
+
+    // Wrap function(args...) into a task that reports exceptions to the
+    // exception handler
+    template <typename Function, typename... Args>
+    task_type make_post_task(Function&& function, Args&&... args) {
+      return [this, function = std::forward<Function>(function),
+              arguments = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+        try {
+          std::apply(std::move(function), std::move(arguments));
+        } catch (...) {
+          handle_exception(std::current_exception());
+        }
+      };
+    }
+
+    // Wrap function(args...) into a task that can be run more than once;
+    // the result is discarded
+    template <typename Function, typename... Args>
+    static task_type make_repeatable_task(Function&& function, Args&&... args) {
+      return [function = std::forward<Function>(function),
+              arguments = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+        std::apply(function, arguments);
+      };
+    }
+
+    bool is_elastic() const { return max_size_ > core_size_; }
+
+    // Pinned workers belong to the node of their CPU, the others are dealt
+    // out over the nodes in turn
+    std::size_t node_of_worker(std::size_t index) const {
+      if (nodes_.empty()) {
+        return 0;
+      }
+      if (!placement_.empty()) {
+        const unsigned int cpu = placement_[index % placement_.size()];
+        for (std::size_t node = 0; node < nodes_.size(); ++node) {
+          if (std::find(nodes_[node].begin(), nodes_[node].end(), cpu) != nodes_[node].end()) {
+            return node;
+          }
+        }
+      }
+      return index % nodes_.size();
+    }
+
+    // Start a worker thread in slot index; requires resize_mutex_
+    void spawn_worker(std::size_t index) {
+      auto& worker = workers_[index];
+      if (worker.joinable()) {
+        // A retired worker that may still be on its way out
+        worker.join();
+      }
+
+      worker = thread_type(thread_attributes{options_.stack_size}, [this, index] {
+        worker_loop(index);
+      });
+      states_[index].active = true;
+      if (!placement_.empty()) {
+        internal::pin_thread(worker.native_handle(), {placement_[index % placement_.size()]});
+      } else if (!nodes_.empty()) {
+        internal::pin_thread(worker.native_handle(), nodes_[states_[index].node]);
+      }
+
+      const std::size_t size = size_.fetch_add(1) + 1;
+      if (size > high_water_mark_.load()) {
+        high_water_mark_.store(size);
+      }
+    }
+
+    void worker_loop(std::size_t index) {
+      current_pool_ = this;
+      worker_index_ = index;
+      internal::this_thread_wait_helper =
+          internal::wait_helper{this, &thread_pool::help, &thread_pool::park, &thread_pool::wake};
+      if (!options_.thread_name_prefix.empty()) {
+        internal::set_current_thread_name(options_.thread_name_prefix + std::to_string(index));
+      }
+
+      const bool can_retire = index >= core_size_;
+      while (!done_) {
+        if (run_pending_task() || spin_for_task()) {
+          continue;
+        }
+        if (can_retire) {
+          if (!wait_for_task(options_.keep_alive) && try_retire(index)) {
+            return;
+          }
+        } else {
+          wait_for_task();
+        }
+      }
+
+      // Don't let this thread (and with it, its interrupt flag) go away
+      // while stop() is still interrupting workers
+      std::lock_guard<std::mutex> guard(resize_mutex_);
+    }
+
+    bool try_retire(std::size_t index) {
+      std::lock_guard<std::mutex> guard(resize_mutex_);
+      if (done_ || pending_.load() > 0) {
+        return false;
+      }
+      states_[index].active = false;
+      size_.fetch_sub(1);
+      return true;
+    }
+
+    // Add a worker if the pool is saturated and allowed to grow
+    void maybe_grow() {
+      if (size_.load() >= max_size_ || idle_.load() > 0) {
+        return;
+      }
+
+      const std::size_t depth = pending_.load();
+      if (depth == 0) {
+        return;
+      }
+      if (depth < options_.grow_queue_depth) {
+        const std::chrono::steady_clock::duration since_dequeue(
+            std::chrono::steady_clock::now().time_since_epoch().count() -
+            last_dequeue_.load(std::memory_order_relaxed));
+        if (since_dequeue < options_.grow_queue_wait) {
+          return;
+        }
+      }
+
+      std::unique_lock<std::mutex> lock(resize_mutex_, std::try_to_lock);
+      if (!lock || done_) {
+        // Somebody else is resizing already
+        return;
+      }
+      for (std::size_t i = core_size_; i < max_size_; ++i) {
+        if (!states_[i].active) {
+          spawn_worker(i);
+          // Count the new worker as making progress so the next submit
+          // doesn't immediately spawn yet another one
+          last_dequeue_.store(std::chrono::steady_clock::now().time_since_epoch().count(),
+                              std::memory_order_relaxed);
+          return;
+        }
+      }
+    }
+
+    void stop() {
+      std::lock_guard<std::mutex> guard(resize_mutex_);
+      done_ = true;
+      for (std::size_t i = 0; i < workers_.size(); ++i) {
+        if (states_[i].active) {
+          workers_[i].interrupt();
+        }
+      }
+      // The timer thread only ever ends by being interrupted here
+      timer_thread_.interrupt();
+    }
+
+    timer_handle schedule_timer(std::chrono::steady_clock::time_point due,
+                                std::chrono::steady_clock::duration period, task_type function) {
+      if (done_) {
+        throw std::runtime_error("schedule on stopped thread_pool");
+      }
+      start_timer_thread();
+
+      auto state = std::make_shared<timer_state>();
+      state->function = std::move(function);
+      state->due = due;
+      state->period = period;
+      timer_handle handle(std::shared_ptr<std::atomic<bool>>(state, &state->cancelled));
+      add_timer(std::move(state));
+      return handle;
+    }
+
+    void start_timer_thread() {
+      if (timer_started_.load()) {
+        return;
+      }
+
+      std::lock_guard<std::mutex> guard(resize_mutex_);
+      if (done_) {
+        throw std::runtime_error("schedule on stopped thread_pool");
+      }
+      if (!timer_thread_.joinable()) {
+        timer_thread_ =
+            thread_type(thread_attributes{options_.stack_size}, [this] { timer_loop(); });
+      }
+      timer_started_.store(true);
+    }
+
+    void add_timer(std::shared_ptr<timer_state> state) {
+      std::lock_guard<std::mutex> guard(timer_mutex_);
+      const auto due = state->due;
+      timers_.add(due, std::move(state));
+      if (due < timer_next_) {
+        // The timer thread sleeps for too long; make it look again
+        timer_next_ = due;
+        timer_changed_ = true;
+        timer_cond_.notify_one();
+      }
+    }
+
+    // Move due timers into the run queues and sleep until the next one
+    void timer_loop() {
+      if (!options_.thread_name_prefix.empty()) {
+        internal::set_current_thread_name(options_.thread_name_prefix + "timer");
+      }
+
+      std::vector<std::shared_ptr<timer_state>> expired;
+      std::unique_lock<std::mutex> lock(timer_mutex_);
+      for (;;) {
+        const auto now = std::chrono::steady_clock::now();
+        timers_.advance(now, [&expired](std::shared_ptr<timer_state>&& state) {
+          expired.push_back(std::move(state));
+        });
+
+        if (!expired.empty()) {
+          lock.unlock();
+          for (auto& state : expired) {
+            if (!state->cancelled.load()) {
+              push_task([this, state = std::move(state)] { run_timer(state); });
+            }
+          }
+          expired.clear();
+          lock.lock();
+          continue;
+        }
+
+        const auto next = timers_.next_expiry();
+        timer_next_ = next ? *next : std::chrono::steady_clock::time_point::max();
+        timer_changed_ = false;
+        if (next) {
+          interruptible_wait_for(timer_cond_, lock, *next - now, [this] { return timer_changed_; });
+        } else {
+          interruptible_wait(timer_cond_, lock, [this] { return timer_changed_; });
+        }
+      }
+    }
+
+    void run_timer(const std::shared_ptr<timer_state>& state) {
+      if (state->cancelled.load()) {
+        return;
+      }
+      try {
+        state->function();
+      } catch (...) {
+        handle_exception(std::current_exception());
+      }
+
+      if (state->period > std::chrono::steady_clock::duration::zero() &&
+          !state->cancelled.load() && !done_) {
+        state->due = std::max(state->due + state->period, std::chrono::steady_clock::now());
+        add_timer(state);
+      }
+    }
+
+    // Queue task; submitted tells whether it came from submit() or post()
+    void push_task(task_type task, task_priority priority = task_priority::normal,
+                   bool submitted = false) {
+      queued_task entry{std::move(task), std::chrono::steady_clock::now(), priority, submitted};
+
+      // Count the task before it becomes visible so pending_ never
+      // under-reports; a worker that wakes up early just looks again
+      count_pending(1, submitted);
+      if (is_worker() && priority == task_priority::normal) {
+        states_[worker_index_].tasks.push(std::move(entry));
+      } else {
+        const auto level = static_cast<std::size_t>(priority);
+        queued_[level].fetch_add(1);
+        global_tasks_[level].push(std::move(entry));
+      }
+      wake_workers(1);
+      if (is_elastic()) {
+        maybe_grow();
+      }
+    }
+
+    void push_deadline_task(std::chrono::steady_clock::time_point deadline, task_type task) {
+      queued_task entry{std::move(task), std::chrono::steady_clock::now(), task_priority::high,
+                        true};
+
+      count_pending(1, true);
+      {
+        std::lock_guard<std::mutex> guard(deadline_mutex_);
+        deadline_tasks_.push_back({deadline, deadline_sequence_++, std::move(entry)});
+        std::push_heap(deadline_tasks_.begin(), deadline_tasks_.end());
+        deadline_count_.fetch_add(1);
+      }
+      wake_workers(1);
+      if (is_elastic()) {
+        maybe_grow();
+      }
+    }
+
+    void push_node_task(task_type task, node_hint hint) {
+      queued_task entry{std::move(task), std::chrono::steady_clock::now(), task_priority::normal,
+                        true};
+      auto& queue = *node_tasks_[hint.node % node_tasks_.size()];
+
+      count_pending(1, true);
+      queue.queued.fetch_add(1);
+      queue.tasks.push(std::move(entry));
+      wake_workers(1);
+      if (is_elastic()) {
+        maybe_grow();
+      }
+    }
+
+    // Queue a batch of submitted normal priority tasks
+    void push_tasks(std::vector<queued_task>& tasks) {
+      if (tasks.empty()) {
+        return;
+      }
+
+      count_pending(tasks.size(), true);
+      if (is_worker()) {
+        states_[worker_index_].tasks.push_bulk(tasks.begin(), tasks.end());
+      } else {
+        const auto level = static_cast<std::size_t>(task_priority::normal);
+        queued_[level].fetch_add(tasks.size());
+        global_tasks_[level].push_bulk(tasks.begin(), tasks.end());
+      }
+      wake_workers(tasks.size());
+      if (is_elastic()) {
+        maybe_grow();
+      }
+    }
+
+    void count_pending(std::size_t tasks, bool submitted) {
+      if (submitted) {
+        submitted_.fetch_add(tasks);
+      }
+      pending_.fetch_add(tasks);
+    }
+
+    bool pop_task_from_local_queue(queued_task& entry) {
+      if (!is_worker()) {
+        return false;
+      }
+      auto& queue = states_[worker_index_].tasks;
+      return options_.policy == queue_policy::lifo ? queue.try_pop(entry) : queue.try_steal(entry);
+    }
+
+    bool pop_task_from_deadline_queue(queued_task& entry) {
+      if (deadline_count_.load() == 0) {
+        return false;
+      }
+
+      std::lock_guard<std::mutex> guard(deadline_mutex_);
+      if (deadline_tasks_.empty()) {
+        return false;
+      }
+      std::pop_heap(deadline_tasks_.begin(), deadline_tasks_.end());
+      entry = std::move(deadline_tasks_.back().entry);
+      deadline_tasks_.pop_back();
+      deadline_count_.fetch_sub(1);
+      return true;
+    }
+
+    // Pop from the injection queues, from high priority down to lowest
+    bool pop_task_from_global_queue(queued_task& entry, task_priority lowest) {
+      for (std::size_t level = 0; level <= static_cast<std::size_t>(lowest); ++level) {
+        if (level == normal_level && is_worker()) {
+          if (pop_batch_from_global_queue(entry, level)) {
+            return true;
+          }
+          continue;
+        }
+        // The counters spare us locking empty queues
+        if (queued_[level].load() > 0 && global_tasks_[level].try_pop(entry)) {
+          queued_[level].fetch_sub(1);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // Take a share of the injection queue at level under one lock: the first
+    // task to run now, the rest into the worker's own queue, where they are
+    // up for stealing like any task submitted from a worker. The share is
+    // what falls to each worker, so a shallow queue still gets spread out.
+    bool pop_batch_from_global_queue(queued_task& entry, std::size_t level) {
+      const std::size_t queued = queued_[level].load();
+      if (queued == 0) {
+        return false;
+      }
+      const std::size_t share =
+          std::clamp<std::size_t>(queued / (size_.load() + 1), 1, max_pop_batch);
+
+      auto& state = states_[worker_index_];
+      auto& batch = state.batch;
+      const std::size_t count = global_tasks_[level].try_pop_bulk(std::back_inserter(batch), share);
+      if (count == 0) {
+        return false;
+      }
+      queued_[level].fetch_sub(count);
+
+      entry = std::move(batch.front());
+      // Keep the batch in submission order for the owner
+      if (options_.policy == queue_policy::lifo) {
+        state.tasks.push_bulk(batch.rbegin(), batch.rend() - 1);
+      } else {
+        state.tasks.push_bulk(batch.begin() + 1, batch.end());
+      }
+      batch.clear();
+      return true;
+    }
+
+    // Pop from the queue of the calling worker's node, or from any node's
+    // queue if own_node is false
+    bool pop_task_from_node_queue(queued_task& entry, bool own_node) {
+      if (own_node && !is_worker()) {
+        return false;
+      }
+      const std::size_t count = node_tasks_.size();
+      const std::size_t first = is_worker() ? states_[worker_index_].node : 0;
+      for (std::size_t i = 0; i < (own_node ? 1 : count); ++i) {
+        auto& queue = *node_tasks_[(first + i) % count];
+        if (queue.queued.load() > 0 && queue.tasks.try_pop(entry)) {
+          queue.queued.fetch_sub(1);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    bool pop_task_from_other_thread_queue(queued_task& entry) {
+      // Slots are filled lowest first, so none above the high-water mark
+      // has ever held a task
+      const std::size_t count = high_water_mark_.load();
+      if (count == 0) {
+        return false;
+      }
+      const std::size_t first = is_worker() ? worker_index_ + 1 : 0;
+      const std::size_t node = is_worker() ? states_[worker_index_].node : 0;
+      // Workers of the same node first, then the rest
+      const int passes = nodes_.size() > 1 && is_worker() ? 2 : 1;
+      for (int pass = 0; pass < passes; ++pass) {
+        for (std::size_t i = 0; i < count; ++i) {
+          const std::size_t index = (first + i) % count;
+          if (passes > 1 && (states_[index].node == node) != (pass == 0)) {
+            continue;
+          }
+          if (states_[index].tasks.try_steal(entry)) {
+            return true;
+          }
+        }
+      }
+      return false;
+    }
+
+    void record_wait(const queued_task& entry, std::chrono::steady_clock::time_point now) {
+      // Workers keep their own counts; only other threads share waits_
+      const auto level = static_cast<std::size_t>(entry.priority);
+      auto& counters = is_worker() ? states_[worker_index_].waits[level] : waits_[level];
+      const std::int64_t wait =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(now - entry.enqueued).count();
+      counters.tasks.fetch_add(1, std::memory_order_relaxed);
+      counters.total.fetch_add(wait, std::memory_order_relaxed);
+      std::int64_t max = counters.max.load(std::memory_order_relaxed);
+      while (wait > max && !counters.max.compare_exchange_weak(max, wait,
+                                                                std::memory_order_relaxed)) {
+      }
+    }
+
+    // Promote tasks at the front of the normal and background injection
+    // queues that waited long enough by one level. Runs at most four times
+    // per aging interval, on whichever worker gets there first.
+    void age_queued_tasks(std::chrono::steady_clock::time_point now) {
+      const auto aging = options_.priority_aging;
+      if (aging.count() <= 0) {
+        return;
+      }
+
+      const auto ticks = now.time_since_epoch().count();
+      auto next = next_aging_.load(std::memory_order_relaxed);
+      if (ticks < next) {
+        return;
+      }
+      const std::chrono::steady_clock::duration period = aging / 4;
+      if (!next_aging_.compare_exchange_strong(next, ticks + period.count(),
+                                               std::memory_order_relaxed)) {
+        return;
+      }
+
+      for (std::size_t level = 1; level < priority_levels; ++level) {
+        // A task that started out at priority p and now sits at level is
+        // due for promotion after waiting (p - level + 1) aging intervals
+        const auto due = [&](const queued_task& entry) {
+          const auto steps = static_cast<std::size_t>(entry.priority) - level + 1;
+          return now - entry.enqueued >= aging * steps;
+        };
+
+        queued_task entry;
+        while (queued_[level].load() > 0 && global_tasks_[level].try_pop_if(entry, due)) {
+          queued_[level - 1].fetch_add(1);
+          global_tasks_[level - 1].push(std::move(entry));
+          queued_[level].fetch_sub(1);
+        }
+      }
+    }
+
+    // Spin, then yield, for a while before parking, so a task that arrives
+    // right after the queues ran dry gets picked up without a wakeup; returns
+    // whether there is something to run
+    bool spin_for_task() {
+      for (std::size_t i = 0; i < spin_rounds + yield_rounds; ++i) {
+        if (pending_.load(std::memory_order_relaxed) > 0 || done_.load(std::memory_order_relaxed)) {
+          return true;
+        }
+        if (i < spin_rounds) {
+          internal::cpu_relax();
+        } else {
+          std::this_thread::yield();
+        }
+      }
+      return false;
+    }
+
+    // Park the calling worker until there is something to run or it gets
+    // interrupted
+    void wait_for_task() {
+      auto& state = states_[worker_index_];
+      std::unique_lock<std::mutex> lock(state.park_mutex);
+      park_guard guard(state.parked, idle_);
+      interruptible_wait(state.park_cond, lock, [this, &state] { return woken(state); });
+    }
+
+    // Like wait_for_task() but gives up after timeout; returns whether
+    // there may be something to run
+    bool wait_for_task(std::chrono::milliseconds timeout) {
+      auto& state = states_[worker_index_];
+      std::unique_lock<std::mutex> lock(state.park_mutex);
+      park_guard guard(state.parked, idle_);
+      return interruptible_wait_for(state.park_cond, lock, timeout,
+                                    [this, &state] { return woken(state); });
+    }
+
+    bool woken(const worker_state& state) const {
+      return !state.parked.load() || pending_.load() > 0;
+    }
+
+    // Wake up to count parked workers, each on its own condition variable,
+    // so a push only touches the workers it wakes. Workers set parked and
+    // then register in idle_ before checking pending_, so a push either
+    // gets seen by that check or sees the worker as parked here. Clearing
+    // parked and passing through the worker's lock is enough for that;
+    // like locked_queue::push, it notifies after releasing the lock.
+    //
+    // Slots are tried from the first, so the core workers get the work and
+    // the elastic ones stay parked long enough to retire. idle_ stays a
+    // pool-wide count, as maybe_grow() needs it and pushes must not scan
+    // the slots while no worker is parked.
+    void wake_workers(std::size_t count) {
+      if (idle_.load() > 0) {
+        std::size_t woken = 0;
+        for (std::size_t i = 0; i < max_size_ && woken < count; ++i) {
+          auto& state = states_[i];
+          if (state.parked.load() && state.parked.exchange(false)) {
+            std::unique_lock<std::mutex> lock(state.park_mutex);
+            lock.unlock();
+            state.park_cond.notify_one();
+            ++woken;
+          }
+        }
+      }
+
+      if (helpers_.load() > 0) {
+        std::unique_lock<std::mutex> lock(help_mutex_);
+        const std::size_t helpers = helpers_.load();
+        lock.unlock();
+        // Threads helping while they wait for something else get to run
+        // the tasks as well
+        notify(help_cond_, helpers, count);
+      }
+    }
+
+    // Wake count of the waiting threads on cond
+    template <typename Condition>
+    static void notify(Condition& cond, std::size_t waiting, std::size_t count) {
+      if (waiting == 0) {
+        return;
+      }
+      if (count >= waiting) {
+        cond.notify_all();
+      } else {
+        for (std::size_t i = 0; i < count; ++i) {
+          cond.notify_one();
+        }
+      }
+    }
+
+    inline static thread_local thread_pool* current_pool_ = nullptr;
+    inline static thread_local std::size_t worker_index_ = 0;
+
+    const thread_pool_options options_;
+    const std::size_t core_size_;
+    const std::size_t max_size_;
+    // CPUs to pin workers to; empty if they are not pinned
+    const std::vector<unsigned int> placement_;
+    // CPUs of every NUMA node; empty unless numa_aware
+    const std::vector<std::vector<unsigned int>> nodes_;
+    // The atomics every worker looks at all the time are grouped by how
+    // often they change, each group on a cache line of its own: done_ is
+    // read on every round of a worker but written once; pending_ and
+    // submitted_ change with every task; idle_ through high_water_mark_
+    // when workers park or spawn; last_dequeue_ and next_aging_ when an
+    // elastic pool dequeues and when tasks get aged. queued_ changes with
+    // every task through the injection queues and has a line of its own.
+    alignas(internal::cache_line_size) std::atomic<bool> done_;
+    alignas(internal::cache_line_size) std::atomic<std::size_t> pending_;
+    // Queued tasks that came from submit() or post()
+    std::atomic<std::size_t> submitted_;
+    alignas(internal::cache_line_size) std::atomic<std::size_t> idle_;
+    // Threads parked in park_helper
+    std::atomic<std::size_t> helpers_;
+    std::atomic<std::size_t> size_;
+    std::atomic<std::size_t> high_water_mark_;
+    // steady_clock ticks at which a task was last taken off a queue
+    alignas(internal::cache_line_size) std::atomic<std::chrono::steady_clock::rep> last_dequeue_;
+    // steady_clock ticks after which queued tasks get aged next
+    std::atomic<std::chrono::steady_clock::rep> next_aging_;
+    // Injection queues and the number of tasks in them, by priority
+    std::array<task_queue, priority_levels> global_tasks_;
+    alignas(internal::cache_line_size)
+        std::array<std::atomic<std::size_t>, priority_levels> queued_;
+    // Injection queue of every NUMA node, for submissions with a node_hint
+    std::vector<std::unique_ptr<node_queue>> node_tasks_;
+    std::array<wait_counters, priority_levels> waits_;
+    // Submitters waiting for room under overflow_policy::block
+    std::mutex room_mutex_;
+    std::condition_variable_any room_cond_;
+    std::atomic<std::size_t> blocked_submitters_;
+    std::array<std::atomic<std::uint64_t>, overflow_outcomes> overflow_counts_;
+    // Heap of tasks with a deadline, its size, and the next sequence number
+    std::mutex deadline_mutex_;
+    std::vector<deadline_task> deadline_tasks_;
+    std::atomic<std::size_t> deadline_count_;
+    std::uint64_t deadline_sequence_;
+    // One control block per worker slot, next to each other in memory
+    const std::unique_ptr<worker_state[]> states_;
+    // Where threads in park_helper wait
+    std::mutex help_mutex_;
+    std::condition_variable help_cond_;
+    std::mutex resize_mutex_;
+    // Delayed and periodic tasks; timer_next_ is when the timer thread
+    // plans to wake up next
+    std::mutex timer_mutex_;
+    std::condition_variable_any timer_cond_;
+    timer_wheel<std::shared_ptr<timer_state>> timers_;
+    std::chrono::steady_clock::time_point timer_next_;
+    bool timer_changed_;
+    std::atomic<bool> timer_started_;
+    thread_type timer_thread_;
+    std::vector<thread_type> workers_;
+    join_threads joiner_;
+  };
+
+  static_assert(std::is_default_constructible<thread_pool>::value);
+  static_assert(!std::is_copy_constructible<thread_pool>::value);
+  static_assert(!std::is_copy_assignable<thread_pool>::value);
+  static_assert(!std::is_move_constructible<thread_pool>::value);
+  static_assert(!std::is_move_assignable<thread_pool>::value);
+
+  namespace internal {
+    // Gives the algorithms built on top of thread_pool access to its
+    // internals
+    class pool_access final {
+    public:
+      // Queue task without a future; task must not throw. Throws
+      // std::runtime_error if pool is stopped, like submit().
+      static void execute(thread_pool& pool, unique_task task) {
+        if (pool.done_) {
+          throw std::runtime_error("execute on stopped thread_pool");
+        }
+        pool.push_task(std::move(task));
+      }
+
+      // Where continuations of futures from pool run
+      static executor_ref executor(thread_pool& pool) { return pool.continuation_executor(); }
+
+      // Run pending tasks of pool on the calling thread until ready()
+      // returns true; see thread_pool::help_until
+      template <typename Predicate> static void help_until(thread_pool& pool, Predicate ready) {
+        pool.help_until(ready);
+      }
+
+      // To be called after making the ready() of a help_until true
+      static void wake_helpers(thread_pool& pool) { pool.wake_helpers(); }
+    };
+  } // namespace internal
 
   // Returns whether f has a result; doesn't block
   template <typename T> bool is_ready(const std::future<T>& f) {
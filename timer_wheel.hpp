@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace foo {
+  // Handle to a task scheduled on a thread_pool with schedule_after,
+  // schedule_at or schedule_every; lets you cancel it
+  class timer_handle final {
+  public:
+    // Construct a handle that refers to nothing
+    timer_handle() = default;
+
+    explicit timer_handle(std::shared_ptr<std::atomic<bool>> cancelled)
+        : cancelled_(std::move(cancelled)) {}
+
+    // Prevent the task from running (again); a run that already started
+    // completes
+    void cancel() {
+      if (cancelled_) {
+        cancelled_->store(true);
+      }
+    }
+
+    bool cancelled() const { return cancelled_ && cancelled_->load(); }
+
+    // Returns true if this handle refers to a scheduled task
+    bool valid() const noexcept { return static_cast<bool>(cancelled_); }
+
+  private:
+    std::shared_ptr<std::atomic<bool>> cancelled_;
+  };
+
+  static_assert(std::is_nothrow_default_constructible<timer_handle>::value);
+  static_assert(std::is_copy_constructible<timer_handle>::value);
+  static_assert(std::is_nothrow_move_constructible<timer_handle>::value);
+
+  // A hierarchical timer wheel (Varghese and Lauck): level 0 has one slot
+  // per tick for the next slots_per_level ticks, every further level covers
+  // slots_per_level times the range of the one below. Entries are moved
+  // down a level whenever the wheel below completes a revolution, so adding
+  // and expiring entries is O(1) no matter how many are pending.
+  //
+  // Not thread-safe; meant to be driven by a single timer thread.
+  template <typename T> class timer_wheel final {
+  public:
+    typedef T value_type;
+    typedef std::chrono::steady_clock clock_type;
+
+    static constexpr std::size_t levels = 4;
+    static constexpr std::size_t slot_bits = 6;
+    static constexpr std::size_t slots_per_level = std::size_t(1) << slot_bits;
+
+    explicit timer_wheel(clock_type::duration resolution = std::chrono::milliseconds(1),
+                         clock_type::time_point origin = clock_type::now())
+        : resolution_(resolution), origin_(origin), current_(0), size_(0), wheels_(),
+          overflow_() {}
+
+    // Add value to expire at due; values that are already due expire on
+    // the next call to advance
+    void add(clock_type::time_point due, value_type value) {
+      // The current tick has been processed already
+      const std::uint64_t tick = std::max(to_tick(due), current_ + 1);
+      insert(entry{tick, std::move(value)});
+      ++size_;
+    }
+
+    // Advance the wheel to now and pass every value that expired to
+    // on_expired(value_type&&), in order of expiry
+    template <typename Function> void advance(clock_type::time_point now, Function&& on_expired) {
+      const std::uint64_t target = to_tick(now);
+      if (size_ == 0) {
+        current_ = std::max(current_, target);
+        return;
+      }
+
+      while (current_ < target) {
+        ++current_;
+        cascade();
+
+        auto& slot = wheels_[0][current_ & slot_mask];
+        std::vector<entry> expired;
+        expired.swap(slot);
+        size_ -= expired.size();
+        for (auto& e : expired) {
+          on_expired(std::move(e.value));
+        }
+        if (size_ == 0) {
+          current_ = target;
+        }
+      }
+    }
+
+    // Returns the point in time the wheel next needs to be advanced at, or
+    // nothing if it is empty; never later than the next expiry
+    std::optional<clock_type::time_point> next_expiry() const {
+      if (size_ == 0) {
+        return std::nullopt;
+      }
+
+      // Look for the next occupied slot in the current revolution of level
+      // 0; if there is none, the next cascade is due at its end
+      std::uint64_t tick = current_ + 1;
+      for (; (tick & slot_mask) != 0; ++tick) {
+        if (!wheels_[0][tick & slot_mask].empty()) {
+          break;
+        }
+      }
+      return origin_ + resolution_ * static_cast<clock_type::rep>(tick);
+    }
+
+    std::size_t size() const noexcept { return size_; }
+
+    bool empty() const noexcept { return size_ == 0; }
+
+  private:
+    static constexpr std::uint64_t slot_mask = slots_per_level - 1;
+
+    struct entry {
+      std::uint64_t tick;
+      value_type value;
+    };
+
+    // Round up, so nothing expires before it is due
+    std::uint64_t to_tick(clock_type::time_point time) const {
+      if (time <= origin_) {
+        return 0;
+      }
+      const auto elapsed = (time - origin_).count();
+      const auto resolution = resolution_.count();
+      return static_cast<std::uint64_t>((elapsed + resolution - 1) / resolution);
+    }
+
+    // Put e into the lowest level whose range reaches e.tick
+    void insert(entry e) {
+      const std::uint64_t delta = e.tick - current_;
+      for (std::size_t level = 0; level < levels; ++level) {
+        if (delta < (std::uint64_t(1) << (slot_bits * (level + 1)))) {
+          const auto slot = (e.tick >> (slot_bits * level)) & slot_mask;
+          wheels_[level][slot].push_back(std::move(e));
+          return;
+        }
+      }
+      overflow_.push_back(std::move(e));
+    }
+
+    // When a level completes a revolution, spread the slot of the level
+    // above that covers the next revolution over the levels below
+    void cascade() {
+      for (std::size_t level = 1; level < levels; ++level) {
+        if ((current_ & ((std::uint64_t(1) << (slot_bits * level)) - 1)) != 0) {
+          return;
+        }
+
+        const auto slot = (current_ >> (slot_bits * level)) & slot_mask;
+        std::vector<entry> entries;
+        entries.swap(wheels_[level][slot]);
+        for (auto& e : entries) {
+          insert(std::move(e));
+        }
+      }
+
+      // Every revolution of the top level, retry what did not fit before
+      if ((current_ & ((std::uint64_t(1) << (slot_bits * levels)) - 1)) == 0) {
+        std::vector<entry> entries;
+        entries.swap(overflow_);
+        for (auto& e : entries) {
+          insert(std::move(e));
+        }
+      }
+    }
+
+    const clock_type::duration resolution_;
+    const clock_type::time_point origin_;
+    // Last tick advance() processed
+    std::uint64_t current_;
+    std::size_t size_;
+    std::array<std::array<std::vector<entry>, slots_per_level>, levels> wheels_;
+    // Entries further out than the top level reaches
+    std::vector<entry> overflow_;
+  };
+
+  static_assert(std::is_move_constructible<timer_wheel<int>>::value);
+  static_assert(!std::is_copy_assignable<timer_wheel<int>>::value);
+} // namespace foo
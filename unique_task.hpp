@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace foo {
+  // A move-only, type-erased void() callable, for queuing work without
+  // std::function's copyability requirement
+  //
+  // Callables of up to inline_size bytes that can be moved without throwing
+  // are stored in place, so wrapping a small lambda does not allocate.
+  // Larger callables are kept on the heap.
+  class unique_task final {
+  public:
+    static constexpr std::size_t inline_size = 64;
+
+    // Construct an empty task
+    unique_task() noexcept : storage_(), ops_(nullptr) {}
+
+    // Construct from any callable that can be invoked without arguments;
+    // implicit, like std::function
+    template <typename Function, typename = std::enable_if_t<
+                                     !std::is_same<std::decay_t<Function>, unique_task>::value>>
+    unique_task(Function&& function) : storage_(), ops_(nullptr) {
+      typedef std::decay_t<Function> function_type;
+      static_assert(std::is_invocable<function_type&>::value,
+                    "unique_task requires a callable taking no arguments");
+
+      if constexpr (stored_inline<function_type>()) {
+        ::new (static_cast<void*>(&storage_)) function_type(std::forward<Function>(function));
+        ops_ = &inline_operations<function_type>::table;
+      } else {
+        ::new (static_cast<void*>(&storage_))
+            function_type*(new function_type(std::forward<Function>(function)));
+        ops_ = &heap_operations<function_type>::table;
+      }
+    }
+
+    unique_task(unique_task&& other) noexcept : storage_(), ops_(other.ops_) {
+      if (ops_) {
+        ops_->move(&other.storage_, &storage_);
+        other.ops_ = nullptr;
+      }
+    }
+
+    unique_task& operator=(unique_task&& rhs) noexcept {
+      if (this != &rhs) {
+        reset();
+        if (rhs.ops_) {
+          rhs.ops_->move(&rhs.storage_, &storage_);
+          ops_ = rhs.ops_;
+          rhs.ops_ = nullptr;
+        }
+      }
+      return *this;
+    }
+
+    unique_task(const unique_task&) = delete;
+    unique_task& operator=(const unique_task&) = delete;
+
+    ~unique_task() { reset(); }
+
+    // Returns true if there is a callable to run
+    explicit operator bool() const noexcept { return ops_ != nullptr; }
+
+    // Run the callable; must not be empty
+    void operator()() { ops_->invoke(&storage_); }
+
+    // Destroy the callable, leaving this task empty
+    void reset() noexcept {
+      if (ops_) {
+        ops_->destroy(&storage_);
+        ops_ = nullptr;
+      }
+    }
+
+    // Returns true if a callable of type Function is stored without
+    // allocating
+    template <typename Function> static constexpr bool stored_inline() {
+      return sizeof(Function) <= inline_size && alignof(Function) <= alignof(storage_type) &&
+             std::is_nothrow_move_constructible<Function>::value;
+    }
+
+  private:
+    typedef std::aligned_storage_t<inline_size, alignof(std::max_align_t)> storage_type;
+
+    struct operations {
+      void (*invoke)(void* storage);
+      // Move-construct into to and destroy what is left in from
+      void (*move)(void* from, void* to) noexcept;
+      void (*destroy)(void* storage) noexcept;
+    };
+
+    template <typename Function> struct inline_operations {
+      static Function& get(void* storage) { return *std::launder(static_cast<Function*>(storage)); }
+
+      static void invoke(void* storage) { std::invoke(get(storage)); }
+
+      static void move(void* from, void* to) noexcept {
+        ::new (to) Function(std::move(get(from)));
+        get(from).~Function();
+      }
+
+      static void destroy(void* storage) noexcept { get(storage).~Function(); }
+
+      static constexpr operations table = {&invoke, &move, &destroy};
+    };
+
+    template <typename Function> struct heap_operations {
+      static Function*& get(void* storage) {
+        return *std::launder(static_cast<Function**>(storage));
+      }
+
+      static void invoke(void* storage) { std::invoke(*get(storage)); }
+
+      static void move(void* from, void* to) noexcept { ::new (to) Function*(get(from)); }
+
+      static void destroy(void* storage) noexcept { delete get(storage); }
+
+      static constexpr operations table = {&invoke, &move, &destroy};
+    };
+
+    storage_type storage_;
+    const operations* ops_;
+  };
+
+  static_assert(std::is_nothrow_default_constructible<unique_task>::value);
+  static_assert(!std::is_copy_constructible<unique_task>::value);
+  static_assert(!std::is_copy_assignable<unique_task>::value);
+  static_assert(std::is_nothrow_move_constructible<unique_task>::value);
+  static_assert(std::is_nothrow_move_assignable<unique_task>::value);
+} // namespace foo